@@ -0,0 +1,384 @@
+#include <benchmark/benchmark.h>
+
+#include "torch_png/Png.hpp"
+#include "torch_png/Shard.hpp"
+
+#include <torch/torch.h>
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+/**
+ * @brief Content of the synthetic images, from the hardest to the easiest to compress
+ */
+enum Content { Noise = 0, Gradient = 1, Flat = 2 };
+
+/**
+ * @brief Label of a Content in the results
+ */
+const char* content_name(std::int64_t content) {
+    static const char* names[] = {"noise", "gradient", "flat"};
+    return names[content];
+}
+/**
+ * @brief Synthetic {channels, size, size} image:
+ *      - Noise: uniform noise (incompressible)
+ *      - Gradient: horizontal gradient with some noise, compressible but not trivially so (like natural images)
+ *      - Flat: a single color
+ *
+ * @param channels
+ * @param size
+ * @param content
+ * @return torch::Tensor
+ */
+torch::Tensor make_image(std::int64_t channels, std::int64_t size, std::int64_t content = Gradient) {
+    const auto options = torch::TensorOptions().dtype(torch::kInt32);
+
+    torch::Tensor image;
+    if (content == Noise) {
+        image = torch::randint(0, 256, {channels, size, size}, options);
+    } else if (content == Flat) {
+        image = torch::full({channels, size, size}, 127, options);
+    } else {
+        const auto gradient =
+            torch::arange(size, options).remainder(256).view({1, 1, size}).expand({channels, size, size});
+        image = (gradient + torch::randint(0, 16, {channels, size, size}, options)).remainder(256);
+    }
+    return image.to(torch::kUInt8).contiguous();
+}
+/**
+ * @brief Png files encoded once per process for the decode benchmarks (encoding a 8k noise image takes seconds),
+ * removed at exit
+ */
+class EncodedFiles {
+  public:
+    ~EncodedFiles() {
+        for (const auto& filepath : filepaths_)
+            torch_png::fs::remove(filepath);
+    }
+    /**
+     * @brief Path of the png file of make_image(channels, size, content), encoded with the default options
+     */
+    torch_png::fs::path get(std::int64_t channels, std::int64_t size, std::int64_t content) {
+        const auto filepath = torch_png::fs::temp_directory_path() /
+                              ("torch_png_bench_" + std::to_string(size) + "_" + std::to_string(channels) + "_" +
+                               content_name(content) + ".png");
+        if (filepaths_.insert(filepath).second)
+            torch_png::encode(filepath, make_image(channels, size, content));
+        return filepath;
+    }
+
+  private:
+    std::set<torch_png::fs::path> filepaths_;
+};
+
+EncodedFiles& encoded_files() {
+    static EncodedFiles files;
+    return files;
+}
+/**
+ * @brief Raw image throughput (bytes_per_second) and images per second (items_per_second)
+ */
+void set_throughput(benchmark::State& state, std::int64_t images, std::int64_t image_bytes) {
+    state.SetItemsProcessed(state.iterations() * images);
+    state.SetBytesProcessed(state.iterations() * images * image_bytes);
+}
+/**
+ * @brief Sizes (64² to 8k²), channels (1 to 4) and contents of the decode/encode benchmarks
+ */
+void image_args(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"size", "channels", "content"})
+        ->ArgsProduct({{64, 512, 4096, 8192}, {1, 2, 3, 4}, {Noise, Gradient, Flat}})
+        ->Unit(benchmark::kMillisecond);
+}
+/**
+ * @brief decode of a png file. Args: size, channels, content
+ */
+void BM_Decode(benchmark::State& state) {
+    const auto size     = state.range(0);
+    const auto channels = state.range(1);
+    const auto filepath = encoded_files().get(channels, size, state.range(2));
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(torch_png::decode(filepath));
+    set_throughput(state, 1, channels * size * size);
+    state.SetLabel(content_name(state.range(2)));
+    state.counters["file_bytes"] = static_cast<double>(torch_png::fs::file_size(filepath));
+}
+/**
+ * @brief encode to a png file. Args: size, channels, content
+ */
+void BM_Encode(benchmark::State& state) {
+    const auto size     = state.range(0);
+    const auto channels = state.range(1);
+    const auto image    = make_image(channels, size, state.range(2));
+    const auto filepath = torch_png::fs::temp_directory_path() / "torch_png_bench_encode.png";
+
+    for (auto _ : state)
+        torch_png::encode(filepath, image);
+    set_throughput(state, 1, image.numel());
+    state.SetLabel(content_name(state.range(2)));
+    state.counters["ratio"] = static_cast<double>(torch_png::fs::file_size(filepath)) / image.numel();
+    torch_png::fs::remove(filepath);
+}
+/**
+ * @brief encode_batch of 32 rgb images. Args: size, threads (1: single thread)
+ */
+void BM_EncodeBatch(benchmark::State& state) {
+    const std::int64_t batch    = 32;
+    const auto         size     = state.range(0);
+    const auto         images   = make_image(3, size).unsqueeze(0).expand({batch, 3, size, size}).contiguous();
+    const auto         filepath = torch_png::fs::temp_directory_path() / "torch_png_bench_batch.png";
+
+    std::vector<torch_png::EncodeResult> results;
+    for (auto _ : state)
+        results = torch_png::encode_batch(filepath, images, "_", torch_png::EncodeOptions(), state.range(1));
+    set_throughput(state, batch, 3 * size * size);
+
+    for (const auto& result : results)
+        torch_png::fs::remove(result.filepath);
+}
+/**
+ * @brief decode_batch of 32 rgb files. Args: size, threads (1: single thread)
+ */
+void BM_DecodeBatch(benchmark::State& state) {
+    const std::int64_t batch    = 32;
+    const auto         size     = state.range(0);
+    const auto         filepath = encoded_files().get(3, size, Gradient);
+    // decode_batch runs on the OpenMP default number of threads
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(static_cast<int>(state.range(1)));
+#endif
+    for (auto _ : state)
+        benchmark::DoNotOptimize(torch_png::decode_batch(std::vector<torch_png::fs::path>(batch, filepath)));
+    set_throughput(state, batch, 3 * size * size);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+}
+/**
+ * @brief Batches of 32 rgb images decoded from a shard of 256 images, shuffled (ShardReader::decode_batch)
+ * or scanned (ShardReader::decode_range), the counterpart of BM_DecodeBatch. Args: size, threads
+ */
+void BM_DecodeShard(benchmark::State& state, torch_png::ShardAccess access) {
+    const std::int64_t batch    = 32;
+    const std::size_t  items    = 256;
+    const auto         size     = state.range(0);
+    const auto         filepath = torch_png::fs::temp_directory_path() / "torch_png_bench_shard.tpng";
+    {
+        const auto bytes = torch_png::encode_to_memory(make_image(3, size));
+        torch_png::ShardWriter writer(filepath);
+        for (std::size_t i = 0; i < items; ++i)
+            writer.add_encoded(bytes.data_ptr<std::uint8_t>(), static_cast<std::size_t>(bytes.numel()));
+        writer.close();
+    }
+    const torch_png::ShardReader reader(filepath, access);
+
+    std::mt19937                               generator(0);
+    std::uniform_int_distribution<std::size_t> index(0, items - 1);
+    std::vector<std::size_t>                   indices(batch);
+    std::size_t                                first = 0;
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(static_cast<int>(state.range(1)));
+#endif
+    for (auto _ : state) {
+        if (access == torch_png::ShardAccess::Random) {
+            for (auto& i : indices)
+                i = index(generator);
+            benchmark::DoNotOptimize(reader.decode_batch(indices));
+        } else {
+            benchmark::DoNotOptimize(reader.decode_range(first, batch));
+            first = (first + batch) % items;
+        }
+    }
+    set_throughput(state, batch, 3 * size * size);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    torch_png::fs::remove(filepath);
+}
+/**
+ * @brief Sizes and thread counts of the batch benchmarks
+ */
+void batch_args(benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"size", "threads"})
+        ->ArgsProduct({{64, 512}, {1, 2, 4, 8}})
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+}
+/**
+ * @brief Encoding presets compared by BM_EncodeOptions
+ */
+const std::map<std::string, torch_png::EncodeOptions>& presets() {
+    static const std::map<std::string, torch_png::EncodeOptions> presets = [] {
+        torch_png::EncodeOptions stored;
+        stored.compression_level = 0;
+        stored.filters           = PNG_FILTER_NONE;
+
+        return std::map<std::string, torch_png::EncodeOptions>{{"default", torch_png::EncodeOptions()},
+                                                               {"fast", torch_png::EncodeOptions::fast()},
+                                                               {"best", torch_png::EncodeOptions::best()},
+                                                               {"stored", stored}};
+    }();
+    return presets;
+}
+/**
+ * @brief Speed/size trade-off of the encoding presets.
+ * bytes_per_second is the raw image throughput, ratio the encoded size over the raw size.
+ */
+void BM_EncodeOptions(benchmark::State& state, const std::string& preset) {
+    const auto image   = make_image(3, state.range(0));
+    const auto options = presets().at(preset);
+
+    std::int64_t encoded_bytes = 0;
+    for (auto _ : state) {
+        const auto bytes = torch_png::encode_to_memory(image, options);
+        encoded_bytes    = bytes.numel();
+        benchmark::DoNotOptimize(encoded_bytes);
+    }
+    state.SetBytesProcessed(state.iterations() * image.numel());
+    state.counters["ratio"] = static_cast<double>(encoded_bytes) / image.numel();
+}
+
+/**
+ * @brief Multithreaded encoding of a large image, Arg: EncodeOptions::threads (1: libpng)
+ */
+void BM_EncodeThreads(benchmark::State& state) {
+    const auto image = make_image(3, 4096);
+
+    torch_png::EncodeOptions options;
+    options.threads = static_cast<int>(state.range(0));
+
+    std::int64_t encoded_bytes = 0;
+    for (auto _ : state) {
+        const auto bytes = torch_png::encode_to_memory(image, options);
+        encoded_bytes    = bytes.numel();
+        benchmark::DoNotOptimize(encoded_bytes);
+    }
+    state.SetBytesProcessed(state.iterations() * image.numel());
+    state.counters["ratio"] = static_cast<double>(encoded_bytes) / image.numel();
+}
+/**
+ * @brief Streaming encoding of a large image in strips of rows to a byte counting sink. Arg: rows per strip
+ */
+void BM_StreamEncode(benchmark::State& state) {
+    const auto image = make_image(3, 4096);
+    const auto strip = state.range(0);
+
+    std::int64_t encoded_bytes = 0;
+    for (auto _ : state) {
+        encoded_bytes = 0;
+        torch_png::StreamEncoder encoder(
+            [&encoded_bytes](const std::uint8_t*, std::size_t size) { encoded_bytes += size; }, 4096, 4096, 3);
+        for (std::int64_t y = 0; y < 4096; y += strip)
+            encoder.write_rows(image.narrow(1, y, std::min<std::int64_t>(strip, 4096 - y)));
+        encoder.close();
+        benchmark::DoNotOptimize(encoded_bytes);
+    }
+    state.SetBytesProcessed(state.iterations() * image.numel());
+    state.counters["ratio"] = static_cast<double>(encoded_bytes) / image.numel();
+}
+/**
+ * @brief Decoding of a large stored (level 0) file, the file read dominates. Arg: size of the image
+ */
+void BM_DecodeFile(benchmark::State& state) {
+    const auto image    = make_image(3, state.range(0));
+    const auto filepath = torch_png::fs::temp_directory_path() / "torch_png_bench_decode.png";
+
+    torch_png::EncodeOptions options;
+    options.compression_level = 0;
+    options.filters           = PNG_FILTER_NONE;
+    torch_png::encode(filepath, image, options);
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(torch_png::decode(filepath));
+    state.SetBytesProcessed(state.iterations() * torch_png::fs::file_size(filepath));
+    torch_png::fs::remove(filepath);
+}
+/**
+ * @brief Decoding of a rgb file to a normalized float tensor, fused in the decoder (DecodeOptions::mean and stddev)
+ * or with the tensor operations after an 8 bit decode. Arg: size of the image
+ */
+void BM_DecodeNormalized(benchmark::State& state, bool fused) {
+    const auto size     = state.range(0);
+    const auto filepath = encoded_files().get(3, size, Gradient);
+    const auto mean     = torch::tensor({0.485f, 0.456f, 0.406f}).view({3, 1, 1});
+    const auto stddev   = torch::tensor({0.229f, 0.224f, 0.225f}).view({3, 1, 1});
+
+    torch_png::DecodeOptions options;
+    options.dtype  = torch::kFloat;
+    options.mean   = {0.485f, 0.456f, 0.406f};
+    options.stddev = {0.229f, 0.224f, 0.225f};
+
+    for (auto _ : state) {
+        if (fused)
+            benchmark::DoNotOptimize(torch_png::decode(filepath, options));
+        else
+            benchmark::DoNotOptimize(torch_png::decode(filepath).to(torch::kFloat).div(255).sub(mean).div(stddev));
+    }
+    set_throughput(state, 1, 3 * size * size);
+}
+
+/**
+ * @brief Decoding of the first passes of an Adam7 interlaced rgb file (progressive display).
+ * Arg: number of passes decoded
+ */
+void BM_DecodeProgressive(benchmark::State& state) {
+    const auto filepath = torch_png::fs::temp_directory_path() / "torch_png_bench_progressive.png";
+
+    torch_png::EncodeOptions encode_options;
+    encode_options.interlace = true;
+    torch_png::encode(filepath, make_image(3, 2048, Gradient), encode_options);
+
+    torch_png::DecodeOptions options;
+    options.adam7_passes = static_cast<int>(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(torch_png::decode(filepath, options));
+    set_throughput(state, 1, 3 * 2048 * 2048);
+    torch_png::fs::remove(filepath);
+}
+
+}  // namespace
+
+BENCHMARK(BM_Decode)->Apply(image_args);
+BENCHMARK(BM_Encode)->Apply(image_args);
+
+BENCHMARK(BM_EncodeBatch)->Apply(batch_args);
+BENCHMARK(BM_DecodeBatch)->Apply(batch_args);
+BENCHMARK_CAPTURE(BM_DecodeShard, random, torch_png::ShardAccess::Random)->Apply(batch_args);
+BENCHMARK_CAPTURE(BM_DecodeShard, sequential, torch_png::ShardAccess::Sequential)->Apply(batch_args);
+
+BENCHMARK_CAPTURE(BM_EncodeOptions, default, std::string("default"))->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeOptions, fast, std::string("fast"))->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeOptions, best, std::string("best"))->Arg(256)->Arg(1024);
+BENCHMARK_CAPTURE(BM_EncodeOptions, stored, std::string("stored"))->Arg(256)->Arg(1024);
+
+BENCHMARK_CAPTURE(BM_DecodeNormalized, fused, true)->Arg(512)->Arg(4096)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_DecodeNormalized, unfused, false)->Arg(512)->Arg(4096)->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_DecodeProgressive)->DenseRange(1, 7)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_DecodeFile)->Arg(1024)->Arg(8192)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_EncodeThreads)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime()->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_StreamEncode)->Arg(1)->Arg(64)->Arg(1024)->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv) {
+    // reported with the results (console and json) so that the runs of the backends can be told apart
+    benchmark::AddCustomContext("torch_png_backend", torch_png::backend());
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -3,11 +3,19 @@
 #include <png.h>
 #include <torch/torch.h>
 
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <vector>
 /**
- * @brief libtorch handles only torch::UInt8 which are of depth 8.
- * Other bitdepths have not been considered when writting this code.
+ * @brief 8 bit pngs are decoded to torch::kUInt8 and 16 bit pngs to torch::kInt32 by default,
+ * see DecodeOptions::dtype. torch::kUInt8 tensors are encoded to 8 bit pngs,
+ * torch::kInt16, torch::kInt32 and torch::kFloat tensors to 16 bit pngs.
  *
  * ** LIBPNG ENCODING/DECODING **
  * Color    Allowed    Interpretation
@@ -33,6 +41,10 @@
  *  2           8       -> rgb        [0, 255]
  *  4           8       -> gray alpha [0, 255]
  *  6           8       -> rgb alpha  [0, 255]
+ *  0, 2, 4, 6  16      -> same colors [0, 65535] (or [0, 1] as torch::kFloat)
+ *  0           1,2,4   -> gray       [0, 255] (scaled)
+ *  3           1,2,4,8 -> rgb, or rgb alpha with a tRNS chunk [0, 255]
+ *                         (or the palette indices, see DecodeOptions::palette_indices)
  */
 namespace torch_png {
 
@@ -46,6 +58,129 @@ static constexpr std::uint8_t channel_idx_to_color[4] = {
     PNG_COLOR_TYPE_RGB,        /*    2     */
     PNG_COLOR_TYPE_RGB_ALPHA   /*    6     */
 };
+/**
+ * @brief Base class of the errors raised when a png can't be read or written
+ * (unreadable file, corrupted or truncated data, libpng error, ...).
+ * Invalid arguments (e.g. a tensor that can't be encoded) are reported as std::invalid_argument.
+ */
+class Error : public std::runtime_error {
+  public:
+    /**
+     * @param source file path or "<memory>" for in memory buffers
+     * @param reason
+     */
+    Error(const std::string& source, const std::string& reason);
+
+    const std::string& source() const noexcept;
+
+    const std::string& reason() const noexcept;
+
+  private:
+    std::string source_;
+    std::string reason_;
+};
+/**
+ * @brief Raised when a png can't be decoded
+ */
+class DecodeError : public Error {
+  public:
+    using Error::Error;
+};
+/**
+ * @brief Raised when a png can't be encoded
+ */
+class EncodeError : public Error {
+  public:
+    using Error::Error;
+};
+/**
+ * @brief Memory layout of a decoded image
+ */
+enum class Layout {
+    CHW, /* planar      {channels, height, width} */
+    HWC  /* interleaved {height, width, channels}, as stored in the png rows */
+};
+/**
+ * @brief How the pixels of a block are reduced by a downscaled decode
+ */
+enum class Downscale {
+    Box,      /* average of the block, partial blocks on the bottom/right edges average the pixels they hold */
+    Subsample /* top left pixel of the block. Adam7 interlaced pngs only read the passes holding those pixels */
+};
+/**
+ * @brief Options controlling how a png is decoded
+ */
+struct DecodeOptions {
+    // CHW de-interleaves each decoded row straight into the planes, HWC keeps the png layout
+    Layout layout = Layout::CHW;
+    // type of the decoded tensor, the conversion is fused in the row loop. Unset: torch::kUInt8 for 8 bit pngs
+    // and torch::kInt32 for 16 bit pngs. torch::kFloat, torch::kHalf and torch::kBFloat16 are normalized to [0, 1]
+    // (see scale, mean and stddev), torch::kUInt8 keeps the 8 most significant bits and torch::kInt16 keeps
+    // the 16 bits (samples above 32767 wrap to negative values)
+    std::optional<torch::Dtype> dtype;
+    // per channel normalization of the floating point dtypes, applied while the rows are converted:
+    // (sample / max_sample * scale[c] - mean[c]) / stddev[c], max_sample being 255 (65535 for 16 bit pngs).
+    // Each is empty (1, 0 and 1), a single value for all the channels or one value per decoded channel
+    std::vector<float> scale;
+    std::vector<float> mean;
+    std::vector<float> stddev;
+    // palette pngs are decoded to their raw indices {1, height, width} (e.g. label maps) instead of rgb (alpha) colors
+    bool palette_indices = false;
+    // 1, 2, 4 or 8: the image is downscaled while its rows are decoded, to dims
+    // {ceil(height / scale_factor), ceil(width / scale_factor)}
+    int       scale_factor = 1;
+    Downscale downscale    = Downscale::Box;
+    // number of passes of Adam7 interlaced pngs decoded, 1 to 7 (progressive display). The following passes are
+    // never inflated and the pixels they hold are replicated from the decoded ones: the image keeps its dims,
+    // with blocks of 8 x 8 pixels after the first pass, 4 x 8, 4 x 4, 2 x 4, 2 x 2 and 1 x 2 (width x height)
+    // after the next ones. Non interlaced pngs ignore it
+    int adam7_passes = 7;
+};
+/**
+ * @brief Options controlling the compression of an encoded png.
+ * -1 keeps the libpng default of a setting.
+ * Lower levels and a single cheap filter trade file size for throughput.
+ */
+struct EncodeOptions {
+    // zlib level, from 0 (stored, fastest) to 9 (smallest). libpng default: 6
+    int compression_level = -1;
+    // zlib strategy: Z_DEFAULT_STRATEGY (0), Z_FILTERED (1), Z_HUFFMAN_ONLY (2), Z_RLE (3) or Z_FIXED (4).
+    // libpng default: Z_FILTERED
+    int strategy = -1;
+    // mask of the row filters libpng chooses from: PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP,
+    // PNG_FILTER_AVG, PNG_FILTER_PAETH or PNG_ALL_FILTERS. libpng default: PNG_ALL_FILTERS (adaptive)
+    int filters = -1;
+    // log2 of the zlib window size, from 8 to 15. libpng default: 15 (reduced for small images)
+    int window_bits = -1;
+    // zlib memory level, from 1 to 9. libpng default: 8
+    int mem_level = -1;
+    // 1 encodes with libpng (single zlib stream). Otherwise bands of rows are filtered and deflated
+    // on this many threads (0: all the OpenMP threads) and stitched in a standard png, for large images.
+    int threads = 1;
+    // Adam7 interlaced png, displayable progressively (see DecodeOptions::adam7_passes) but usually larger.
+    // Always encoded by libpng, on a single thread whatever threads
+    bool interlace = false;
+    /**
+     * @brief Maximum throughput: level 1, run length encoding of the PNG_FILTER_SUB filtered rows
+     */
+    static EncodeOptions fast();
+    /**
+     * @brief Smallest files (archival): level 9 with adaptive filtering
+     */
+    static EncodeOptions best();
+};
+/**
+ * @brief What decode_batch does when the images of a batch have different heights or widths
+ */
+enum class BatchPolicy {
+    Error, /* throws std::invalid_argument */
+    Pad    /* images are zero padded (bottom, right) to the largest height and width of the batch */
+};
+/**
+ * @brief Libraries the decoders and encoders were built with (TORCH_PNG_BACKEND), with their versions,
+ * e.g. "libpng 1.6.43, zlib 1.3.1" or "libspng 0.7.4 (decode), libpng 1.6.43, zlib 1.3.1"
+ */
+std::string backend();
 /**
  * @brief Get the PNG infos:
  *      - height
@@ -53,34 +188,338 @@ static constexpr std::uint8_t channel_idx_to_color[4] = {
  *      - channels
  *      - bit depth
  *      - color type
+ * Only the signature and the IHDR chunk (33 bytes) are read and checked, without libpng.
  *
  * @param filepath
+ * @param validate also reads the chunks up to the image data with libpng (CRCs, chunk order, ...)
+ * @return std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t>
+ */
+std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t> getDims(const fs::path& filepath,
+                                                                                          bool validate = false);
+/**
+ * @brief Get the PNG infos (see getDims) of a png buffer, errors are thrown as DecodeError with source "<memory>"
+ *
+ * @param data
+ * @param size
+ * @param validate see getDims
  * @return std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t>
  */
-std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t> getDims(const fs::path& filepath);
+std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t>
+getDims_from_memory(const std::uint8_t* data, std::size_t size, bool validate = false);
+/**
+ * @brief PNG infos of a list of files (struct of arrays), see probe_many
+ */
+struct ProbeResults {
+    std::vector<std::int32_t> height;
+    std::vector<std::int32_t> width;
+    std::vector<std::uint8_t> channels;
+    std::vector<std::uint8_t> bit_depth;
+    std::vector<std::uint8_t> color_type;
+    // error of each file (e.g. DecodeError), null on success. The infos of a failed file are 0
+    std::vector<std::exception_ptr> errors;
+};
+/**
+ * @brief Get the PNG infos (see getDims) of many files in parallel, e.g. to bucket a dataset by size.
+ * A file that can't be probed doesn't stop the others, its error is reported in the results.
+ *
+ * @param filepaths
+ * @param validate see getDims
+ * @param threads number of threads, 0 uses the OpenMP default
+ * @return ProbeResults one entry per file in each array
+ */
+ProbeResults probe_many(const std::vector<fs::path>& filepaths, bool validate = false, int threads = 0);
 /**
  * @brief Reads a png file and returns a torch tensor
- * with dims {channels, height, width}
+ * with dims {channels, height, width} (or {height, width, channels} if options.layout is Layout::HWC)
+ *
+ * @param filepath
+ * @param options
+ * @return 3D torch::Tensor
+ */
+torch::Tensor decode(const fs::path& filepath, const DecodeOptions& options = DecodeOptions());
+/**
+ * @brief Decodes the region [y0, y0 + height) x [x0, x0 + width) of a png file.
+ * Only the requested columns are written to a tensor the size of the region, and the file is read
+ * up to the last row of the region (the rows above it still have to be decompressed).
  *
  * @param filepath
+ * @param y0 first row
+ * @param x0 first column
+ * @param height number of rows
+ * @param width number of columns
+ * @param options
+ * @return 3D torch::Tensor with dims {channels, height, width} (or {height, width, channels})
+ */
+torch::Tensor decode_roi(const fs::path&      filepath,
+                         std::int64_t         y0,
+                         std::int64_t         x0,
+                         std::int64_t         height,
+                         std::int64_t         width,
+                         const DecodeOptions& options = DecodeOptions());
+/**
+ * @brief Decodes a png held in memory and returns a torch tensor
+ * with dims {channels, height, width}.
+ * The buffer is read in place by libpng, no intermediate copy is made.
+ *
+ * @param data pointer to the first byte of the png signature
+ * @param size number of bytes available from data
+ * @param options
+ * @return 3D torch::Tensor
+ */
+torch::Tensor decode_from_memory(const std::uint8_t*  data,
+                                 std::size_t          size,
+                                 const DecodeOptions& options = DecodeOptions());
+/**
+ * @brief Decodes a png held in a contiguous cpu torch::kUInt8 tensor of bytes
+ * and returns a torch tensor with dims {channels, height, width}
+ *
+ * @param bytes encoded png bytes (e.g. torch::from_blob over a message payload)
+ * @param options
  * @return 3D torch::Tensor
  */
-torch::Tensor decode(const fs::path& filepath);
+torch::Tensor decode_from_memory(const torch::Tensor& bytes, const DecodeOptions& options = DecodeOptions());
 /**
- * @brief writes a png file from a torch tensor of dims {channels, height, width}
+ * @brief Decodes png files in parallel into a single batched tensor
+ * with dims {batch, channels, height, width} (or {batch, height, width, channels} if options.layout is Layout::HWC).
+ * The headers are read first so that the output is allocated once and each file is decoded straight into its slice.
+ * All the images must have the same number of channels.
+ *
+ * @param filepaths
+ * @param policy what to do when the images heights or widths differ
+ * @param options
+ * @return 4D torch::Tensor
+ */
+torch::Tensor decode_batch(const std::vector<fs::path>& filepaths,
+                           BatchPolicy                  policy  = BatchPolicy::Error,
+                           const DecodeOptions&         options = DecodeOptions());
+/**
+ * @brief Png bytes held in memory, not owned (e.g. an item of a memory mapped shard, see ShardReader)
+ */
+struct PngBuffer {
+    const std::uint8_t* data = NULL;
+    std::size_t         size = 0;
+    // reported in the errors of the buffer, "<memory>" if empty
+    std::string source;
+};
+/**
+ * @brief Decodes png buffers in parallel into a single batched tensor, see decode_batch.
+ * The buffers are read in place, no intermediate copy is made.
+ *
+ * @param buffers
+ * @param policy what to do when the images heights or widths differ
+ * @param options
+ * @return 4D torch::Tensor
+ */
+torch::Tensor decode_batch_from_memory(const std::vector<PngBuffer>& buffers,
+                                       BatchPolicy                   policy  = BatchPolicy::Error,
+                                       const DecodeOptions&          options = DecodeOptions());
+/**
+ * @brief writes a png file from a torch tensor of dims {channels, height, width}.
+ * torch::kUInt8 tensors are written as 8 bit pngs. torch::kInt16 (bits kept), torch::kInt32 (clamped to [0, 65535])
+ * and torch::kFloat (clamped to [0, 1]) tensors are written as 16 bit pngs.
  *
  * @param filepath
  * @param torch_tensor 3D torch::Tensor
+ * @param options
  */
-void encode(const fs::path& filepath, const torch::Tensor& tensor);
+void encode(const fs::path& filepath, const torch::Tensor& tensor, const EncodeOptions& options = EncodeOptions());
+/**
+ * @brief Encodes a torch tensor of dims {channels, height, width} to png bytes in memory.
+ * The bytes are written by libpng in a buffer reserved once for the worst case size
+ * and whose ownership is handed over to the returned tensor (no final copy).
+ *
+ * @param tensor 3D torch::Tensor
+ * @param options
+ * @return 1D torch::kUInt8 torch::Tensor holding the png file content
+ */
+torch::Tensor encode_to_memory(const torch::Tensor& tensor, const EncodeOptions& options = EncodeOptions());
+/**
+ * @brief Outcome of the encoding of an item of encode_batch
+ */
+struct EncodeResult {
+    fs::path filepath;
+    // size of the written file
+    std::size_t bytes = 0;
+    // error of the item (e.g. EncodeError), null on success
+    std::exception_ptr error;
+
+    bool ok() const noexcept;
+};
 /**
  * @brief Encodes a batch of images into a (sequence of) png files
  * if a batch dimension is provided, then the stem will be <stem> += "{delimiter}{#batch}" + <ext>
+ * The output paths are built up front, the items are strided views of the batch (no per item copy)
+ * encoded with dynamic scheduling so that a large image doesn't stall the other threads.
+ * Failing items don't stop the batch, they are reported in the results.
  *
  * @param filepath
  * @param tensor 4D torch::Tensor
  * @param delimiter can be any string, "_", "__", "-" except forbidden ones "/", ":", "." etc
+ * @param options
+ * @param threads number of threads encoding items, 0 uses the OpenMP default
+ * @return std::vector<EncodeResult> path, size and error of each item
+ */
+std::vector<EncodeResult> encode_batch(fs::path             filepath,
+                                       const torch::Tensor& tensor,
+                                       const std::string&   delimiter = "_",
+                                       const EncodeOptions& options   = EncodeOptions(),
+                                       int                  threads   = 0);
+/**
+ * @brief Encodes a batch of images to png bytes in memory, in parallel (see encode_batch and encode_to_memory).
+ * The first error (by index) is rethrown once all the items are done.
+ *
+ * @param tensor 4D torch::Tensor
+ * @param options
+ * @param threads number of threads encoding items, 0 uses the OpenMP default
+ * @return std::vector<torch::Tensor> 1D torch::kUInt8 tensors, the png bytes of each item
+ */
+std::vector<torch::Tensor> encode_batch_to_memory(const torch::Tensor& tensor,
+                                                  const EncodeOptions& options = EncodeOptions(),
+                                                  int                  threads = 0);
+
+/**
+ * @brief Reusable png decoder for streams of images (tiles, thumbnails, sprites, ...).
+ * libpng structs can't be reset between images, so instead the decoder recycles every block
+ * libpng and zlib allocate (structs, inflate state and window, row buffers) as well as its own
+ * row buffer. decode_into fills a preallocated tensor so that decoding allocates nothing once warm.
+ * Not thread safe: use one decoder per thread.
  */
-void encode_batch(fs::path filepath, const torch::Tensor& tensor, const std::string& delimiter = "_");
+class Decoder {
+  public:
+    explicit Decoder(const DecodeOptions& options = DecodeOptions());
+
+    ~Decoder();
+
+    Decoder(Decoder&&) noexcept;
+
+    Decoder& operator=(Decoder&&) noexcept;
+    /**
+     * @brief see torch_png::decode
+     */
+    torch::Tensor decode(const fs::path& filepath);
+    /**
+     * @brief see torch_png::decode_from_memory
+     */
+    torch::Tensor decode(const std::uint8_t* data, std::size_t size);
+    /**
+     * @brief Decodes a png file in out, whose dims must match the image:
+     * {channels, height, width} (or {height, width, channels} if the layout is Layout::HWC).
+     * out may be a view (e.g. a slice of a batch) as long as its rows are contiguous.
+     *
+     * @param filepath
+     * @param out 3D cpu tensor of the decoded type (see DecodeOptions::dtype)
+     */
+    void decode_into(const fs::path& filepath, const torch::Tensor& out);
+    /**
+     * @brief Decodes a png buffer in out, see decode_into(const fs::path&, const torch::Tensor&)
+     *
+     * @param data
+     * @param size
+     * @param out 3D cpu tensor of the decoded type (see DecodeOptions::dtype)
+     */
+    void decode_into(const std::uint8_t* data, std::size_t size, const torch::Tensor& out);
+
+  private:
+    struct Impl;
+
+    DecodeOptions         options_;
+    std::unique_ptr<Impl> impl_;
+};
+/**
+ * @brief Reusable png encoder, the counterpart of Decoder.
+ * It recycles the libpng/zlib allocations, its row buffer and the output buffer of encode_to_buffer.
+ * Not thread safe: use one encoder per thread.
+ */
+class Encoder {
+  public:
+    explicit Encoder(const EncodeOptions& options = EncodeOptions());
+
+    ~Encoder();
+
+    Encoder(Encoder&&) noexcept;
+
+    Encoder& operator=(Encoder&&) noexcept;
+    /**
+     * @brief see torch_png::encode
+     */
+    void encode(const fs::path& filepath, const torch::Tensor& tensor);
+    /**
+     * @brief Encodes a tensor of dims {channels, height, width} in the internal buffer of the encoder
+     *
+     * @param tensor 3D torch::Tensor
+     * @return const std::vector<std::uint8_t>& png bytes, valid until the next call
+     */
+    const std::vector<std::uint8_t>& encode_to_buffer(const torch::Tensor& tensor);
+
+  private:
+    struct Impl;
+
+    EncodeOptions         options_;
+    std::unique_ptr<Impl> impl_;
+};
+/**
+ * @brief Receives the bytes of a png encoded by a StreamEncoder, in order
+ */
+using Sink = std::function<void(const std::uint8_t* data, std::size_t size)>;
+/**
+ * @brief Png encoder of images produced strip by strip (renderers, line scan sensors, ...).
+ * The rows are filtered and deflated as they are written and the compressed bytes are written out
+ * in IDAT chunks as soon as they fill the output buffer, so the memory used doesn't depend on the image height.
+ * The png bit depth is the one of the first strip (8 bit for torch::kUInt8, 16 bit otherwise, see encode),
+ * EncodeOptions::threads is ignored (a single zlib stream).
+ * Destroying an encoder that hasn't been closed abandons the png, the file of a path encoder is removed.
+ * Not thread safe.
+ */
+class StreamEncoder {
+  public:
+    /**
+     * @brief Creates (or truncates) the png file, errors are thrown as EncodeError
+     *
+     * @param filepath
+     * @param height
+     * @param width
+     * @param channels 1 to 4
+     * @param options
+     */
+    StreamEncoder(const fs::path&      filepath,
+                  std::int64_t         height,
+                  std::int64_t         width,
+                  std::int64_t         channels,
+                  const EncodeOptions& options = EncodeOptions());
+    /**
+     * @brief Encoder writing to a sink (socket, archive, memory, ...). The exceptions of the sink are propagated.
+     */
+    StreamEncoder(Sink                 sink,
+                  std::int64_t         height,
+                  std::int64_t         width,
+                  std::int64_t         channels,
+                  const EncodeOptions& options = EncodeOptions());
+
+    ~StreamEncoder();
+
+    StreamEncoder(StreamEncoder&&) noexcept;
+
+    StreamEncoder& operator=(StreamEncoder&&) noexcept;
+    /**
+     * @brief Encodes the next rows of the image
+     *
+     * @param rows tensor with dims {channels, strip height, width} and any strides, moved to the cpu if needed
+     */
+    void write_rows(const torch::Tensor& rows);
+    /**
+     * @brief Finishes the png once all the rows have been written (throws EncodeError otherwise)
+     * and closes the file. Does nothing if already closed.
+     */
+    void close();
+    /**
+     * @brief Number of rows written so far
+     */
+    std::int64_t rows_written() const noexcept;
+
+  private:
+    struct Impl;
+
+    std::unique_ptr<Impl> impl_;
+};
 
 }  // namespace torch_png
\ No newline at end of file
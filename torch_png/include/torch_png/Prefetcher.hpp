@@ -0,0 +1,98 @@
+#pragma once
+
+#include "torch_png/Png.hpp"
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace torch_png {
+/**
+ * @brief Options of a Prefetcher
+ */
+struct PrefetchOptions {
+    // number of decoding threads, 0: std::thread::hardware_concurrency()
+    int workers = 0;
+    // maximum number of items (images or batches) decoded or being decoded ahead of the consumer, 0: 2 * workers.
+    // Workers block (backpressure) when the consumer is that many items behind.
+    std::size_t capacity = 0;
+    // 0: items are single images. Otherwise items are batches {batch_size, ...} of consecutive paths
+    // (the last one may be smaller) whose images must have the same dims
+    std::int64_t batch_size = 0;
+    // items are returned in page-locked memory for faster (async) host to device copies. Needs a CUDA build
+    bool pin_memory = false;
+    // options of every decode
+    DecodeOptions decode_options;
+};
+/**
+ * @brief Counters of a Prefetcher, see Prefetcher::stats
+ */
+struct PrefetchStats {
+    // decoded items waiting to be consumed
+    std::size_t queue_depth = 0;
+    // items being decoded
+    std::size_t in_flight = 0;
+    std::size_t capacity  = 0;
+    // items decoded (successfully or not) and returned by next
+    std::uint64_t produced = 0;
+    std::uint64_t consumed = 0;
+    // total time the workers were blocked on a full queue (backpressure: the consumer is the bottleneck)
+    double producer_wait_seconds = 0;
+    // total time next waited for an item (starvation: decoding is the bottleneck)
+    double consumer_wait_seconds = 0;
+};
+/**
+ * @brief Decodes png files ahead of consumption on a pool of worker threads.
+ * Items are decoded out of order into a bounded queue and returned in the order of the paths.
+ * Each worker owns a Decoder, so the libpng allocations are recycled across its items.
+ * A failing item doesn't stop the prefetcher: next rethrows its error and the following call moves on.
+ * Not thread safe: a single consumer calls next.
+ */
+class Prefetcher {
+  public:
+    /**
+     * @brief Called by the workers (one at a time) for the next path, std::nullopt at the end of the stream
+     */
+    using PathGenerator = std::function<std::optional<fs::path>()>;
+    /**
+     * @param filepaths
+     * @param options
+     */
+    explicit Prefetcher(std::vector<fs::path> filepaths, const PrefetchOptions& options = PrefetchOptions());
+    /**
+     * @param generator paths of a stream of unknown size
+     * @param options
+     */
+    explicit Prefetcher(PathGenerator generator, const PrefetchOptions& options = PrefetchOptions());
+    /**
+     * @brief Stops the workers once their current item is decoded
+     */
+    ~Prefetcher();
+
+    Prefetcher(const Prefetcher&) = delete;
+
+    Prefetcher& operator=(const Prefetcher&) = delete;
+    /**
+     * @brief Next item in order: an image (see torch_png::decode) or a batch (see PrefetchOptions::batch_size).
+     * Blocks until it is decoded. Rethrows the error of a failed item (or of the path generator).
+     *
+     * @return std::optional<torch::Tensor> std::nullopt once every item has been returned
+     */
+    std::optional<torch::Tensor> next();
+    /**
+     * @brief Snapshot of the queue depth and of the counters
+     */
+    PrefetchStats stats() const;
+
+  private:
+    struct Impl;
+
+    std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace torch_png
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "torch_png/Png.hpp"
+
+#include <torch/torch.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace torch_png {
+/**
+ * @brief Index entry of a png stored in a shard: where its bytes are and its IHDR infos (see getDims)
+ */
+struct ShardItem {
+    // position of the png bytes in the shard file
+    std::uint64_t offset     = 0;
+    std::uint64_t size       = 0;
+    std::int32_t  height     = 0;
+    std::int32_t  width      = 0;
+    std::uint8_t  channels   = 0;
+    std::uint8_t  bit_depth  = 0;
+    std::uint8_t  color_type = 0;
+};
+/**
+ * @brief Writes many pngs in a single shard file: the png bytes one after the other, followed by an index
+ * of their offsets, sizes and IHDR infos. Millions of small images become a few large files, read without
+ * a per image open() (see ShardReader).
+ * The index is written by close: destroying a writer that hasn't been closed removes the unfinished shard.
+ * Not thread safe, add_batch encodes on several threads.
+ */
+class ShardWriter {
+  public:
+    /**
+     * @brief Creates (or truncates) the shard file, errors are thrown as EncodeError
+     *
+     * @param filepath
+     * @param options options of the images encoded by add and add_batch
+     */
+    explicit ShardWriter(const fs::path& filepath, const EncodeOptions& options = EncodeOptions());
+
+    ~ShardWriter();
+
+    ShardWriter(ShardWriter&&) noexcept;
+
+    ShardWriter& operator=(ShardWriter&&) noexcept;
+    /**
+     * @brief Encodes an image (see encode_to_memory) and appends it
+     *
+     * @param tensor 3D torch::Tensor
+     * @return std::size_t index of the image in the shard
+     */
+    std::size_t add(const torch::Tensor& tensor);
+    /**
+     * @brief Encodes the images of a batch in parallel (see encode_batch_to_memory) and appends them in order.
+     * Nothing is appended if an image fails.
+     *
+     * @param tensor 4D torch::Tensor
+     * @param threads number of threads encoding images, 0 uses the OpenMP default
+     * @return std::size_t index of the first image of the batch in the shard
+     */
+    std::size_t add_batch(const torch::Tensor& tensor, int threads = 0);
+    /**
+     * @brief Appends an already encoded png as is, its IHDR chunk is read for the index (see getDims_from_memory).
+     * A png that can't be probed throws a DecodeError with source "filepath[index]"
+     *
+     * @param data
+     * @param size
+     * @return std::size_t index of the png in the shard
+     */
+    std::size_t add_encoded(const std::uint8_t* data, std::size_t size);
+    /**
+     * @brief Writes the index and closes the file. Closing twice is a no op
+     */
+    void close();
+    /**
+     * @brief Number of pngs appended
+     */
+    std::size_t size() const noexcept;
+
+  private:
+    struct Impl;
+
+    std::unique_ptr<Impl> impl_;
+};
+/**
+ * @brief How a ShardReader is going to be read, passed to the kernel (madvise) for the page cache read ahead
+ */
+enum class ShardAccess {
+    Random,    /* shuffled items: no read ahead, the pages of the items of a batch are requested up front */
+    Sequential /* scans (decode_range in order): aggressive read ahead, the following range is requested early */
+};
+/**
+ * @brief Reads a shard written by ShardWriter. The file is memory mapped once and the pngs are decoded in
+ * place from the mapping, only their pages are read. Decoding is thread safe.
+ */
+class ShardReader {
+  public:
+    /**
+     * @brief Maps the shard and checks its index, errors are thrown as DecodeError
+     *
+     * @param filepath
+     * @param access
+     * @param options options of every decode
+     */
+    explicit ShardReader(const fs::path&      filepath,
+                         ShardAccess          access  = ShardAccess::Random,
+                         const DecodeOptions& options = DecodeOptions());
+
+    ~ShardReader();
+
+    ShardReader(ShardReader&&) noexcept;
+
+    ShardReader& operator=(ShardReader&&) noexcept;
+    /**
+     * @brief Number of pngs in the shard
+     */
+    std::size_t size() const noexcept;
+    /**
+     * @brief Index entry of a png
+     *
+     * @param index in [0, size())
+     * @return const ShardItem&
+     */
+    const ShardItem& item(std::size_t index) const;
+    /**
+     * @brief Decodes a png, see decode_from_memory
+     *
+     * @param index in [0, size())
+     * @return 3D torch::Tensor
+     */
+    torch::Tensor decode(std::size_t index) const;
+    /**
+     * @brief Decodes pngs in parallel into a single batched tensor, see decode_batch_from_memory
+     *
+     * @param indices any order, repeats allowed
+     * @param policy what to do when the images heights or widths differ
+     * @return 4D torch::Tensor
+     */
+    torch::Tensor decode_batch(const std::vector<std::size_t>& indices, BatchPolicy policy = BatchPolicy::Error) const;
+    /**
+     * @brief Decodes the pngs [first, first + count) in parallel into a single batched tensor.
+     * With ShardAccess::Sequential the following count pngs are requested from the kernel meanwhile.
+     *
+     * @param first
+     * @param count
+     * @param policy what to do when the images heights or widths differ
+     * @return 4D torch::Tensor
+     */
+    torch::Tensor decode_range(std::size_t first, std::size_t count, BatchPolicy policy = BatchPolicy::Error) const;
+
+  private:
+    struct Impl;
+
+    std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace torch_png
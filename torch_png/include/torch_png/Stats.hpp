@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+
+namespace torch_png {
+/**
+ * @brief Time and bytes spent in a stage of the decoders/encoders, see stats
+ */
+struct StageStats {
+    // number of timed sections (e.g. one per row)
+    std::uint64_t calls = 0;
+    // time spent in the stage, without the stages nested in it (e.g. the file writes libpng does while deflating)
+    double        seconds = 0;
+    std::uint64_t bytes   = 0;
+};
+/**
+ * @brief Counters of the decode/encode stages, summed over all the threads
+ */
+struct Stats {
+    // decode: chunks up to the image data (png_read_info), getDims and probe_many. encode: the chunks before IDAT
+    StageStats header;
+    // png_read_row: inflate and unfilter. bytes: png rows. The pages of memory mapped files are read here
+    StageStats inflate;
+    // samples copied between the png rows and the tensors (layout, dtype, palette, downscale)
+    // and tensors moved to the cpu before encoding. bytes: png rows
+    StageStats convert;
+    // row filters of the multithreaded encoder (libpng filters the rows while deflating). bytes: png rows
+    StageStats filter;
+    // zlib compression of the filtered rows. bytes: png rows
+    StageStats deflate;
+    // files opened, read or mapped and written. bytes: file bytes
+    StageStats io;
+};
+/**
+ * @brief Whether the library was built with the TORCH_PNG_STATS definition.
+ * The instrumentation compiles to nothing without it and stats only returns zeros.
+ */
+bool stats_enabled() noexcept;
+/**
+ * @brief Snapshot of the counters of all the threads (the running ones and the ones that exited).
+ * Each thread updates its own counters, the snapshot doesn't stop them.
+ */
+Stats stats();
+/**
+ * @brief Zeroes the counters of all the threads
+ */
+void reset_stats();
+
+namespace detail {
+/**
+ * @brief Stages recorded by the instrumentation, in the order of the Stats fields
+ */
+enum class Stage { Header, Inflate, Convert, Filter, Deflate, IO };
+/**
+ * @brief Time recorded so far by the calling thread, in nanoseconds
+ */
+std::uint64_t recorded_nanoseconds() noexcept;
+/**
+ * @brief Records a timed section in the counters of the calling thread
+ *
+ * @param stage
+ * @param nanoseconds duration of the section
+ * @param nested_nanoseconds time recorded by the sections nested in this one, subtracted from its duration
+ * @param bytes
+ */
+void record(Stage stage, std::uint64_t nanoseconds, std::uint64_t nested_nanoseconds, std::uint64_t bytes) noexcept;
+
+}  // namespace detail
+
+}  // namespace torch_png
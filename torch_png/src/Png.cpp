@@ -1,6 +1,31 @@
 #include "torch_png/Png.hpp"
+#include "torch_png/Stats.hpp"
 
+#include <zlib.h>
+
+#ifdef TORCH_PNG_SPNG
+#include <spng.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <initializer_list>
 #include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -8,8 +33,78 @@
 
 namespace torch_png {
 
+Error::Error(const std::string& source, const std::string& reason)
+  : std::runtime_error(source + ": " + reason), source_{source}, reason_{reason} {}
+
+const std::string& Error::source() const noexcept {
+    return source_;
+}
+
+const std::string& Error::reason() const noexcept {
+    return reason_;
+}
+
 namespace {
 
+// source reported in the errors of in memory decoding/encoding
+const std::string memory_source = "<memory>";
+// source reported in the errors of the StreamEncoder sinks
+const std::string sink_source = "<sink>";
+
+#ifdef TORCH_PNG_STATS
+using detail::Stage;
+/**
+ * @brief Start of a timed section. Trivially destructible, so libpng can longjmp over it
+ */
+struct StageStart {
+    std::chrono::steady_clock::time_point time;
+    // time recorded by the thread when the section started, see detail::record
+    std::uint64_t recorded;
+};
+
+inline StageStart stage_start() noexcept {
+    return {std::chrono::steady_clock::now(), detail::recorded_nanoseconds()};
+}
+
+inline void stage_end(Stage stage, const StageStart& start, std::uint64_t bytes) noexcept {
+    const auto elapsed = std::chrono::steady_clock::now() - start.time;
+    detail::record(stage,
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                   detail::recorded_nanoseconds() - start.recorded,
+                   bytes);
+}
+/**
+ * @brief Times its scope. It must not be alive across a libpng call: a longjmp would skip its destructor.
+ */
+class ScopedStage {
+  public:
+    ScopedStage(Stage stage, std::uint64_t bytes) noexcept : stage_{stage}, bytes_{bytes}, start_{stage_start()} {}
+
+    ~ScopedStage() {
+        stage_end(stage_, start_, bytes_);
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+  private:
+    Stage         stage_;
+    std::uint64_t bytes_;
+    StageStart    start_;
+};
+// sections around libpng calls: a StageStart start, then stage_end
+#define TORCH_PNG_STAGE_START(start) const auto start = stage_start()
+#define TORCH_PNG_STAGE_END(stage, start, bytes) stage_end(Stage::stage, start, bytes)
+// sections without libpng calls: the rest of the scope
+#define TORCH_PNG_STAGE_SCOPE(name, stage, bytes) const ScopedStage name(Stage::stage, bytes)
+#else
+// the instrumentation and its arguments compile to nothing
+#define TORCH_PNG_STAGE_START(start) (void)0
+#define TORCH_PNG_STAGE_END(stage, start, bytes) (void)0
+#define TORCH_PNG_STAGE_SCOPE(name, stage, bytes) (void)0
+#endif
+
 typedef std::unique_ptr<FILE, int (*)(FILE*)> unique_fp;
 /**
  * @brief Smart file pointer handler
@@ -21,6 +116,322 @@ typedef std::unique_ptr<FILE, int (*)(FILE*)> unique_fp;
 unique_fp make_unique_fp(const char* filename, const char* flags) {
     return unique_fp(fopen(filename, flags), fclose);
 }
+/**
+ * @brief Read only content of an input file, memory mapped when it is a regular file.
+ * Pipes, character devices and files that cannot be mapped are read (read(2)) in an owned buffer instead.
+ * Decoding from the mapping skips the copies through the stdio buffer.
+ */
+class InputFile {
+  public:
+    /**
+     * @param filepath
+     * @throws DecodeError if the file cannot be opened or read
+     */
+    explicit InputFile(const fs::path& filepath) {
+        const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw DecodeError(filepath.string(), std::string("Cannot open file. ") + std::strerror(errno));
+
+        struct stat status;
+        if (!fstat(fd, &status) && S_ISREG(status.st_mode) && status.st_size > 0) {
+            const auto size = static_cast<std::size_t>(status.st_size);
+            void*      map  = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                // no MADV_SEQUENTIAL: it disables the fault around of the pages already cached, which made warm
+                // decodes slower, while the default read ahead already detects the front to back reads of cold ones
+                map_  = map;
+                data_ = static_cast<const std::uint8_t*>(map);
+                size_ = size;
+                close(fd);
+                return;
+            }
+        }
+        const int error = read_all(fd);
+        close(fd);
+        if (error)
+            throw DecodeError(filepath.string(), std::string("Cannot read file. ") + std::strerror(error));
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+    }
+
+    ~InputFile() {
+        if (map_)
+            munmap(map_, size_);
+    }
+
+    InputFile(const InputFile&) = delete;
+
+    InputFile& operator=(const InputFile&) = delete;
+
+    const std::uint8_t* data() const noexcept {
+        return data_;
+    }
+
+    std::size_t size() const noexcept {
+        return size_;
+    }
+
+  private:
+    /**
+     * @brief Reads fd until its end in buffer_
+     *
+     * @return int errno of the failed read, 0 on success
+     */
+    int read_all(int fd) {
+        std::size_t size = 0;
+        while (true) {
+            if (buffer_.size() - size < 65536)
+                buffer_.resize(std::max<std::size_t>(2 * buffer_.size(), size + 65536));
+
+            const auto count = read(fd, buffer_.data() + size, buffer_.size() - size);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count < 0)
+                return errno;
+            if (!count)
+                break;
+            size += static_cast<std::size_t>(count);
+        }
+        buffer_.resize(size);
+        return 0;
+    }
+
+    void*                     map_  = NULL;
+    const std::uint8_t*       data_ = NULL;
+    std::size_t               size_ = 0;
+    std::vector<std::uint8_t> buffer_;
+};
+/**
+ * @brief Checks the 8 bytes png signature of a file
+ *
+ * @param filepath
+ * @param file content of the file
+ */
+void check_signature(const fs::path& filepath, const InputFile& file) {
+    if (file.size() < 8 || png_sig_cmp((png_const_bytep)file.data(), 0, 8))
+        throw DecodeError(filepath.string(), "Not a png file.");
+}
+/**
+ * @brief Message of the libpng error that interrupted a read or a write, filled by on_png_error
+ */
+struct ErrorContext {
+    char message[256] = "Unknown libpng error.";
+};
+/**
+ * @brief libpng error handler. It records the message and longjmps back to the setjmp of the caller.
+ * The exception is thrown from there so that it never unwinds through libpng C frames.
+ *
+ * @param png_ptr png struct whose error_ptr is an ErrorContext
+ * @param message
+ */
+[[noreturn]] void on_png_error(png_structp png_ptr, png_const_charp message) {
+    auto* error = static_cast<ErrorContext*>(png_get_error_ptr(png_ptr));
+    std::snprintf(error->message, sizeof(error->message), "%s", message);
+    png_longjmp(png_ptr, 1);
+}
+/**
+ * @brief libpng warning handler. Warnings are recoverable so they are silenced.
+ */
+void on_png_warning(png_structp, png_const_charp) {}
+/**
+ * @brief Recycles the memory blocks requested by libpng (png/info structs, zlib state and window,
+ * row buffers) across the images decoded/encoded by a Decoder/Encoder.
+ * Blocks are binned by power of two size classes so that images of slightly different
+ * dims still reuse each others blocks. Not thread safe.
+ */
+class MemoryPool {
+  public:
+    MemoryPool() = default;
+
+    ~MemoryPool() {
+        for (auto& blocks : free_blocks_)
+            for (auto* block : blocks)
+                std::free(block);
+    }
+
+    MemoryPool(const MemoryPool&) = delete;
+    MemoryPool& operator=(const MemoryPool&) = delete;
+
+    void* allocate(std::size_t size) {
+        std::size_t size_class = 0;
+        while ((min_block_size << size_class) < size)
+            ++size_class;
+
+        if (size_class >= free_blocks_.size())
+            free_blocks_.resize(size_class + 1);
+
+        void* block = NULL;
+        if (free_blocks_[size_class].empty()) {
+            block = std::malloc(header_size + (min_block_size << size_class));
+            if (!block)
+                return NULL;
+            // the size class is stored in front of the block for deallocate
+            *static_cast<std::size_t*>(block) = size_class;
+        } else {
+            block = free_blocks_[size_class].back();
+            free_blocks_[size_class].pop_back();
+        }
+        return static_cast<char*>(block) + header_size;
+    }
+
+    void deallocate(void* ptr) {
+        if (!ptr)
+            return;
+        auto* block = static_cast<char*>(ptr) - header_size;
+        free_blocks_[*reinterpret_cast<std::size_t*>(block)].push_back(block);
+    }
+
+  private:
+    // keeps the blocks aligned as malloc would
+    static constexpr std::size_t header_size    = alignof(std::max_align_t);
+    static constexpr std::size_t min_block_size = 64;
+
+    std::vector<std::vector<void*>> free_blocks_;
+};
+/**
+ * @brief libpng allocation callback forwarding to the MemoryPool set as mem_ptr
+ */
+png_voidp pool_malloc(png_structp png_ptr, png_alloc_size_t size) {
+    return static_cast<MemoryPool*>(png_get_mem_ptr(png_ptr))->allocate(size);
+}
+/**
+ * @brief libpng deallocation callback forwarding to the MemoryPool set as mem_ptr
+ */
+void pool_free(png_structp png_ptr, png_voidp ptr) {
+    static_cast<MemoryPool*>(png_get_mem_ptr(png_ptr))->deallocate(ptr);
+}
+/**
+ * @brief Allocations that can be reused across the calls of a Decoder/Encoder.
+ * The free functions use a fresh workspace without pool (libpng default allocator) per call.
+ */
+struct Workspace {
+    explicit Workspace(MemoryPool* pool = NULL) : pool{pool} {}
+
+    MemoryPool*               pool;
+    std::vector<std::uint8_t> row;
+    // palette and sub-byte rows expanded to 8 bit pixels
+    std::vector<std::uint8_t> expanded;
+    // sums of the blocks of a downscaled row (of the whole downscaled image for Adam7 pngs)
+    std::vector<std::uint32_t> accumulator;
+};
+/**
+ * @brief Workspace whose libpng allocations are recycled by its own pool
+ */
+struct PooledWorkspace {
+    MemoryPool pool;
+    Workspace  workspace{&pool};
+};
+/**
+ * @brief Owns the libpng read structs. libpng errors are reported in error.
+ */
+struct ReadStructs {
+    ReadStructs(const std::string& source, MemoryPool* pool) {
+        png_ptr = pool ? png_create_read_struct_2(PNG_LIBPNG_VER_STRING,
+                                                  &error,
+                                                  on_png_error,
+                                                  on_png_warning,
+                                                  pool,
+                                                  pool_malloc,
+                                                  pool_free)
+                       : png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, on_png_error, on_png_warning);
+        if (png_ptr)
+            info_ptr = png_create_info_struct(png_ptr);
+        if (info_ptr)
+            end_info = png_create_info_struct(png_ptr);
+        if (!end_info) {
+            png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+            throw DecodeError(source, "Cannot allocate the libpng read structs.");
+        }
+    }
+    ~ReadStructs() { png_destroy_read_struct(&png_ptr, &info_ptr, &end_info); }
+
+    ReadStructs(const ReadStructs&) = delete;
+    ReadStructs& operator=(const ReadStructs&) = delete;
+
+    ErrorContext error;
+    png_structp  png_ptr  = NULL;
+    png_infop    info_ptr = NULL;
+    png_infop    end_info = NULL;
+};
+/**
+ * @brief Owns the libpng write structs. libpng errors are reported in error.
+ */
+struct WriteStructs {
+    WriteStructs(const std::string& source, MemoryPool* pool) {
+        png_ptr = pool ? png_create_write_struct_2(PNG_LIBPNG_VER_STRING,
+                                                   &error,
+                                                   on_png_error,
+                                                   on_png_warning,
+                                                   pool,
+                                                   pool_malloc,
+                                                   pool_free)
+                       : png_create_write_struct(PNG_LIBPNG_VER_STRING, &error, on_png_error, on_png_warning);
+        if (png_ptr)
+            info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr) {
+            png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+            throw EncodeError(source, "Cannot allocate the libpng write structs.");
+        }
+    }
+    ~WriteStructs() { png_destroy_write_struct(&png_ptr, &info_ptr); }
+
+    WriteStructs(const WriteStructs&) = delete;
+    WriteStructs& operator=(const WriteStructs&) = delete;
+
+    ErrorContext error;
+    png_structp  png_ptr  = NULL;
+    png_infop    info_ptr = NULL;
+};
+/**
+ * @brief Runs body(i) for i in [0, size) with OpenMP (dynamic scheduling).
+ * Exceptions can't leave an OpenMP region: they are caught per iteration and
+ * the first one (by index) is rethrown once all the iterations are done.
+ *
+ * @tparam Body callable with signature void(std::int64_t)
+ * @param size number of iterations
+ * @param body
+ * @param threads number of threads, 0 uses the OpenMP default
+ */
+template <typename Body>
+void parallel_for(std::int64_t size, Body&& body, int threads = 0) {
+    std::vector<std::exception_ptr> errors(size);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(threads > 0 ? threads : omp_get_max_threads())
+#endif
+    for (std::int64_t i = 0; i < size; ++i) {
+        try {
+            body(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    }
+    for (const auto& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+/**
+ * @brief Number of threads parallel_for runs on
+ *
+ * @param threads see parallel_for
+ * @return int
+ */
+int thread_count(int threads) {
+#ifdef _OPENMP
+    return threads > 0 ? threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+/**
+ * @brief Index of the calling thread in [0, thread_count(threads)) within parallel_for
+ */
+int thread_index() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
 
 /**
  * @brief @brief checks if the number of channels are valid
@@ -35,226 +446,3051 @@ bool is_valid_channels(std::int64_t channels) {
     return false;
 }
 /**
- * @brief Checks that tensor is valid and returns a PNG encoded copy
+ * @brief Calls body with a value of the C++ type of a supported image dtype
+ *
+ * @tparam Body generic callable with signature void(T)
+ * @param dtype torch::kUInt8, torch::kInt16, torch::kInt32, torch::kFloat, torch::kHalf or torch::kBFloat16
+ * @param body
+ */
+template <typename Body>
+void dispatch_dtype(torch::Dtype dtype, Body&& body) {
+    switch (dtype) {
+        case torch::kUInt8:
+            body(std::uint8_t());
+            break;
+        case torch::kInt16:
+            body(std::int16_t());
+            break;
+        case torch::kInt32:
+            body(std::int32_t());
+            break;
+        case torch::kFloat:
+            body(float());
+            break;
+        case torch::kHalf:
+            body(c10::Half());
+            break;
+        case torch::kBFloat16:
+            body(c10::BFloat16());
+            break;
+        default:
+            throw std::invalid_argument("Unexpected torch::Tensor type. Expects: torch::kUInt8, torch::kInt16, "
+                                        "torch::kInt32, torch::kFloat, torch::kHalf or torch::kBFloat16");
+    }
+}
+/**
+ * @brief Whether T is one of the floating point types of dispatch_dtype (float, half, bfloat16)
+ */
+template <typename T>
+constexpr bool is_float_v =
+    std::is_floating_point_v<T> || std::is_same_v<T, c10::Half> || std::is_same_v<T, c10::BFloat16>;
+/**
+ * @brief Whether dtype is a floating point image dtype (torch::kFloat, torch::kHalf or torch::kBFloat16)
+ */
+bool is_float_dtype(torch::Dtype dtype) {
+    return dtype == torch::kFloat || dtype == torch::kHalf || dtype == torch::kBFloat16;
+}
+/**
+ * @brief Throws std::invalid_argument if dtype can't hold an image
+ *
+ * @param dtype
+ */
+void check_dtype(torch::Dtype dtype) {
+    dispatch_dtype(dtype, [](auto) {});
+}
+/**
+ * @brief dtype of the decoded image: options.dtype if set, otherwise torch::kUInt8 for 8 bit pngs
+ * and torch::kInt32 for 16 bit pngs
+ *
+ * @param options
+ * @param bit_depth
+ * @return torch::Dtype
+ */
+torch::Dtype output_dtype(const DecodeOptions& options, int bit_depth) {
+    if (options.dtype)
+        return *options.dtype;
+    return bit_depth == 16 ? torch::kInt32 : torch::kUInt8;
+}
+/**
+ * @brief Checks that tensor is a valid {channels, height, width} image and returns it on cpu.
+ * No copy is made unless the tensor lives on another device.
  *
- * @param tensor tensor to check and copy
- * @return torch::Tensor copy of tensor
+ * @param tensor tensor to check
+ * @param strip rows of a StreamEncoder, which may be empty
+ * @return torch::Tensor cpu view of tensor, with its original strides
  */
-torch::Tensor check_transform_cpy(const torch::Tensor& tensor) {
+torch::Tensor check_to_cpu(const torch::Tensor& tensor, bool strip = false) {
     if (tensor.dim() != 3)
         throw std::invalid_argument("Unexpected torch::Tensor dimensions.\nGot(" + std::to_string(tensor.dim()) +
                                     "). Expects 3.");
-    if (tensor.dtype() != torch::kUInt8)
-        throw std::invalid_argument("Unexpected torch::Tensor type. Expects: torch::kUInt8");
+    check_dtype(tensor.scalar_type());
 
     const auto channels = tensor.size(0);
 
     if (!is_valid_channels(channels))
         throw std::invalid_argument("Unexpected torch::Tensor channels.\nGot(" + std::to_string(channels) +
                                     "). Expects 1, 2, 3, 4.");
-    // return to png format
-    return tensor.detach().clone().permute({1, 2, 0}).to(torch::kCPU).contiguous();
+    if ((!strip && !tensor.size(1)) || !tensor.size(2))
+        throw std::invalid_argument("Unexpected torch::Tensor dims (" + std::to_string(channels) + ", " +
+                                    std::to_string(tensor.size(1)) + ", " + std::to_string(tensor.size(2)) +
+                                    "). Expects a non empty image.");
+    // rows are interleaved (and converted to 16 bit samples) on the fly by encode_png whatever the strides
+    if (tensor.device().is_cpu())
+        return tensor.detach();
+
+    TORCH_PNG_STAGE_SCOPE(convert_scope, Convert, tensor.nbytes());
+    return tensor.detach().to(torch::kCPU);
 }
+/**
+ * @brief Checks the output dtype and the scale factor of the decode options
+ *
+ * @param options
+ */
+void check_options(const DecodeOptions& options) {
+    if (options.dtype)
+        check_dtype(*options.dtype);
 
-}  // namespace
+    const bool normalized = !options.scale.empty() || !options.mean.empty() || !options.stddev.empty();
+    if (normalized && !(options.dtype && is_float_dtype(*options.dtype)))
+        throw std::invalid_argument("Unexpected DecodeOptions::dtype. DecodeOptions::scale, mean and stddev expect "
+                                    "torch::kFloat, torch::kHalf or torch::kBFloat16.");
+    if (std::find(options.stddev.begin(), options.stddev.end(), 0.f) != options.stddev.end())
+        throw std::invalid_argument("Unexpected DecodeOptions::stddev. Expects non zero values.");
 
-std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t> getDims(const fs::path& filepath) {
-    char header[8];  // max size that can be checked
-    // open and test if png file
-    auto fp = make_unique_fp(filepath.c_str(), "rb");
-    if (!fp.get())
-        abort();
+    const auto factor = options.scale_factor;
+    if (factor != 1 && factor != 2 && factor != 4 && factor != 8)
+        throw std::invalid_argument("Unexpected DecodeOptions::scale_factor.\nGot(" + std::to_string(factor) +
+                                    "). Expects 1, 2, 4 or 8.");
+    if (options.adam7_passes < 1 || options.adam7_passes > 7)
+        throw std::invalid_argument("Unexpected DecodeOptions::adam7_passes.\nGot(" +
+                                    std::to_string(options.adam7_passes) + "). Expects [1, 7].");
+}
+/**
+ * @brief Size of a downscaled dimension, partial blocks on the edges count as a pixel
+ *
+ * @param size
+ * @param factor
+ * @return std::int64_t
+ */
+std::int64_t scaled_size(std::int64_t size, std::int64_t factor) {
+    return (size + factor - 1) / factor;
+}
+/**
+ * @brief Checks that the settings are either -1 (libpng default) or in their zlib/libpng range
+ *
+ * @param options
+ */
+void check_options(const EncodeOptions& options) {
+    const auto check_range = [](const char* name, int value, int min, int max) {
+        if (value != -1 && (value < min || value > max))
+            throw std::invalid_argument("Unexpected EncodeOptions::" + std::string(name) + ".\nGot(" +
+                                        std::to_string(value) + "). Expects -1 or [" + std::to_string(min) + ", " +
+                                        std::to_string(max) + "].");
+    };
+    check_range("compression_level", options.compression_level, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
+    check_range("strategy", options.strategy, Z_DEFAULT_STRATEGY, Z_FIXED);
+    check_range("filters", options.filters, PNG_FILTER_NONE, PNG_ALL_FILTERS);
+    check_range("window_bits", options.window_bits, 8, 15);
+    check_range("mem_level", options.mem_level, 1, MAX_MEM_LEVEL);
 
-    if (!fread(header, 1, 8, fp.get()))
-        abort();
+    if (options.threads < 0)
+        throw std::invalid_argument("Unexpected EncodeOptions::threads.\nGot(" + std::to_string(options.threads) +
+                                    "). Expects 0 or more.");
 
-    if (png_sig_cmp((png_const_bytep)header, 0, 8))
-        abort();
+    if (options.filters != -1 && (options.filters & ~PNG_ALL_FILTERS))
+        throw std::invalid_argument("Unexpected EncodeOptions::filters. Expects a mask of PNG_FILTER_* flags.");
+}
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        abort();
+/**
+ * @brief Scatters an interleaved row of pixels to the rows of channels planes.
+ * The number of channels is a template parameter so that the compiler unrolls the
+ * inner loop and vectorizes the shuffle.
+ *
+ * @tparam Channels number of interleaved channels
+ * @param row interleaved pixels {width, Channels}
+ * @param planes first element of the row in the first plane
+ * @param width number of pixels in the row
+ * @param plane_stride number of elements between two consecutive planes
+ */
+template <std::int64_t Channels>
+void deinterleave_row(const std::uint8_t* __restrict row,
+                      std::uint8_t* __restrict planes,
+                      std::int64_t width,
+                      std::int64_t plane_stride) {
+    for (std::int64_t x = 0; x < width; ++x)
+        for (std::int64_t c = 0; c < Channels; ++c)
+            planes[c * plane_stride + x] = row[x * Channels + c];
+}
+/**
+ * @brief Dispatches deinterleave_row w.r.t. the number of channels
+ *
+ * @param row interleaved pixels {width, channels}
+ * @param planes first element of the row in the first plane
+ * @param width number of pixels in the row
+ * @param plane_stride number of elements between two consecutive planes
+ * @param channels 1, 2, 3 or 4
+ */
+void deinterleave_row(const std::uint8_t* row,
+                      std::uint8_t*       planes,
+                      std::int64_t        width,
+                      std::int64_t        plane_stride,
+                      std::int64_t        channels) {
+    switch (channels) {
+        case 1:
+            std::memcpy(planes, row, width);
+            break;
+        case 2:
+            deinterleave_row<2>(row, planes, width, plane_stride);
+            break;
+        case 3:
+            deinterleave_row<3>(row, planes, width, plane_stride);
+            break;
+        case 4:
+            deinterleave_row<4>(row, planes, width, plane_stride);
+            break;
+    }
+}
+/**
+ * @brief Gathers the rows of channels planes into an interleaved row of pixels.
+ * The number of channels is a template parameter so that the compiler unrolls the
+ * inner loop and vectorizes the shuffle when the planes rows are contiguous.
+ *
+ * @tparam Channels number of interleaved channels
+ * @param planes first element of the row in the first plane
+ * @param row interleaved pixels {width, Channels}
+ * @param width number of pixels in the row
+ * @param plane_stride number of elements between two consecutive planes
+ * @param pixel_stride number of elements between two consecutive pixels of a plane
+ */
+template <std::int64_t Channels>
+void interleave_row(const std::uint8_t* __restrict planes,
+                    std::uint8_t* __restrict row,
+                    std::int64_t width,
+                    std::int64_t plane_stride,
+                    std::int64_t pixel_stride) {
+    if (pixel_stride == 1) {
+        for (std::int64_t x = 0; x < width; ++x)
+            for (std::int64_t c = 0; c < Channels; ++c)
+                row[x * Channels + c] = planes[c * plane_stride + x];
+    } else {
+        for (std::int64_t x = 0; x < width; ++x)
+            for (std::int64_t c = 0; c < Channels; ++c)
+                row[x * Channels + c] = planes[c * plane_stride + x * pixel_stride];
+    }
+}
+/**
+ * @brief Dispatches interleave_row w.r.t. the number of channels
+ *
+ * @param planes first element of the row in the first plane
+ * @param row interleaved pixels {width, channels}
+ * @param width number of pixels in the row
+ * @param plane_stride number of elements between two consecutive planes
+ * @param pixel_stride number of elements between two consecutive pixels of a plane
+ * @param channels 1, 2, 3 or 4
+ */
+void interleave_row(const std::uint8_t* planes,
+                    std::uint8_t*       row,
+                    std::int64_t        width,
+                    std::int64_t        plane_stride,
+                    std::int64_t        pixel_stride,
+                    std::int64_t        channels) {
+    switch (channels) {
+        case 1:
+            interleave_row<1>(planes, row, width, plane_stride, pixel_stride);
+            break;
+        case 2:
+            interleave_row<2>(planes, row, width, plane_stride, pixel_stride);
+            break;
+        case 3:
+            interleave_row<3>(planes, row, width, plane_stride, pixel_stride);
+            break;
+        case 4:
+            interleave_row<4>(planes, row, width, plane_stride, pixel_stride);
+            break;
+    }
+}
+/**
+ * @brief Lookup table from the samples of palette or sub-byte gray pngs to 8 bit pixels
+ */
+struct Palette {
+    std::uint8_t colors[256][4];
+    int          channels;
+};
+/**
+ * @brief Number of channels of a decoded image: palette pngs are expanded to rgb, or rgb alpha if they
+ * have a tRNS chunk, unless the raw indices are requested.
+ *
+ * @param color_type
+ * @param png_channels channels stored in the png
+ * @param has_trns whether the png has a tRNS chunk
+ * @param options
+ * @return std::int64_t
+ */
+std::int64_t decoded_channels(int color_type, int png_channels, bool has_trns, const DecodeOptions& options) {
+    if (color_type != PNG_COLOR_TYPE_PALETTE || options.palette_indices)
+        return png_channels;
+    return has_trns ? 4 : 3;
+}
+/**
+ * @brief Builds the lookup table of a palette png (PLTE and tRNS chunks, or identity if indices are requested)
+ * or of a 1, 2 or 4 bit gray png (samples scaled to [0, 255]).
+ *
+ * @tparam Color palette entry with red, green and blue members (png_color, spng_plte_entry)
+ * @param color_type
+ * @param bit_depth
+ * @param options
+ * @param colors entries of the PLTE chunk
+ * @param num_colors
+ * @param alphas entries of the tRNS chunk, NULL if the png has none
+ * @param num_alphas
+ * @param palette
+ */
+template <typename Color>
+void fill_palette(int                  color_type,
+                  int                  bit_depth,
+                  const DecodeOptions& options,
+                  const Color*         colors,
+                  int                  num_colors,
+                  const std::uint8_t*  alphas,
+                  int                  num_alphas,
+                  Palette&             palette) {
+    std::memset(palette.colors, 0, sizeof(palette.colors));
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-        abort();
+    if (color_type != PNG_COLOR_TYPE_PALETTE) {
+        // gray levels
+        const auto max_sample = (1 << bit_depth) - 1;
+        for (int i = 0; i <= max_sample; ++i)
+            palette.colors[i][0] = static_cast<std::uint8_t>(i * 255 / max_sample);
+        palette.channels = 1;
+        return;
     }
-    png_infop end_info = png_create_info_struct(png_ptr);
-    if (!end_info) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-        abort();
+    if (options.palette_indices) {
+        for (int i = 0; i < 256; ++i)
+            palette.colors[i][0] = static_cast<std::uint8_t>(i);
+        palette.channels = 1;
+        return;
     }
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-        abort();
+    for (int i = 0; i < num_colors; ++i) {
+        palette.colors[i][0] = colors[i].red;
+        palette.colors[i][1] = colors[i].green;
+        palette.colors[i][2] = colors[i].blue;
+        // entries past the tRNS chunk are opaque
+        palette.colors[i][3] = i < num_alphas ? alphas[i] : 255;
     }
-    png_init_io(png_ptr, fp.get());
-    // lets libpng know there are some bytes missing (the 8 we read)
-    png_set_sig_bytes(png_ptr, 8);
-    // read all the file information up to the actual image data
-    png_read_info(png_ptr, info_ptr);
+    palette.channels = alphas ? 4 : 3;
+}
+/**
+ * @brief fill_palette from the chunks read by libpng.
+ * Must be called from decode_png since libpng may longjmp.
+ *
+ * @param png_ptr
+ * @param info_ptr
+ * @param options
+ * @param palette
+ */
+void read_palette(png_structp png_ptr, png_infop info_ptr, const DecodeOptions& options, Palette& palette) {
+    png_colorp colors     = NULL;
+    int        num_colors = 0;
+    png_bytep  alphas     = NULL;
+    int        num_alphas = 0;
 
-    const auto height     = png_get_image_height(png_ptr, info_ptr);
-    const auto width      = png_get_image_width(png_ptr, info_ptr);
-    const auto channels   = png_get_channels(png_ptr, info_ptr);
-    const auto bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
     const auto color_type = png_get_color_type(png_ptr, info_ptr);
-    // const auto rowbytes = png_get_rowbytes(png_ptr, info_ptr);
-
-    png_read_update_info(png_ptr, info_ptr);
-
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-
-    return {height, width, channels, bit_depth, color_type};
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_get_PLTE(png_ptr, info_ptr, &colors, &num_colors);
+        if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+            png_get_tRNS(png_ptr, info_ptr, &alphas, &num_alphas, NULL);
+    }
+    fill_palette(color_type,
+                 png_get_bit_depth(png_ptr, info_ptr),
+                 options,
+                 colors,
+                 num_colors,
+                 alphas,
+                 num_alphas,
+                 palette);
 }
+/**
+ * @brief Table of the samples packed in a byte, most significant bits first
+ *
+ * @tparam BitDepth 1, 2 or 4
+ * @return const std::array<std::array<std::uint8_t, 8 / BitDepth>, 256>&
+ */
+template <int BitDepth>
+const std::array<std::array<std::uint8_t, 8 / BitDepth>, 256>& unpack_table() {
+    static const auto table = [] {
+        std::array<std::array<std::uint8_t, 8 / BitDepth>, 256> table{};
+        for (int byte = 0; byte < 256; ++byte)
+            for (int k = 0; k < 8 / BitDepth; ++k)
+                table[byte][k] = static_cast<std::uint8_t>((byte >> (8 - BitDepth * (k + 1))) & ((1 << BitDepth) - 1));
+        return table;
+    }();
+    return table;
+}
+/**
+ * @brief Expands a row of palette indices or sub-byte gray samples to interleaved 8 bit pixels.
+ * Each packed byte is unpacked with a single lookup in unpack_table, each sample with a lookup in the palette.
+ *
+ * @tparam Channels channels of the palette
+ * @tparam BitDepth 1, 2, 4 or 8
+ * @param packed png row
+ * @param out {width, Channels} pixels
+ * @param width
+ * @param palette
+ */
+template <int Channels, int BitDepth>
+void expand_row(const std::uint8_t* __restrict packed,
+                std::uint8_t* __restrict out,
+                std::int64_t   width,
+                const Palette& palette) {
+    if constexpr (BitDepth == 8) {
+        for (std::int64_t x = 0; x < width; ++x)
+            for (int c = 0; c < Channels; ++c)
+                out[x * Channels + c] = palette.colors[packed[x]][c];
+    } else {
+        constexpr std::int64_t per_byte = 8 / BitDepth;
+        const auto&            table    = unpack_table<BitDepth>();
 
-torch::Tensor decode(const fs::path& filepath) {
-    char header[8];  // max size that can be checked
-    // open and test if png file
-    auto fp = make_unique_fp(filepath.c_str(), "rb");
-    if (!fp.get())
-        abort();
-
-    if (!fread(header, 1, 8, fp.get()))
-        abort();
-
-    if (png_sig_cmp((png_const_bytep)header, 0, 8))
-        abort();
+        for (std::int64_t x = 0; x < width; x += per_byte) {
+            const auto&        samples = table[packed[x / per_byte]];
+            const std::int64_t count   = std::min(per_byte, width - x);
+            for (std::int64_t k = 0; k < count; ++k)
+                for (int c = 0; c < Channels; ++c)
+                    out[(x + k) * Channels + c] = palette.colors[samples[k]][c];
+        }
+    }
+}
+/**
+ * @brief Dispatches expand_row w.r.t. the palette channels and the bit depth
+ */
+template <int Channels>
+void expand_row(const std::uint8_t* packed,
+                std::uint8_t*       out,
+                std::int64_t        width,
+                int                 bit_depth,
+                const Palette&      palette) {
+    switch (bit_depth) {
+        case 1:
+            expand_row<Channels, 1>(packed, out, width, palette);
+            break;
+        case 2:
+            expand_row<Channels, 2>(packed, out, width, palette);
+            break;
+        case 4:
+            expand_row<Channels, 4>(packed, out, width, palette);
+            break;
+        default:
+            expand_row<Channels, 8>(packed, out, width, palette);
+            break;
+    }
+}
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        abort();
+void expand_row(const std::uint8_t* packed,
+                std::uint8_t*       out,
+                std::int64_t        width,
+                int                 bit_depth,
+                const Palette&      palette) {
+    switch (palette.channels) {
+        case 1:
+            expand_row<1>(packed, out, width, bit_depth, palette);
+            break;
+        case 3:
+            expand_row<3>(packed, out, width, bit_depth, palette);
+            break;
+        default:
+            expand_row<4>(packed, out, width, bit_depth, palette);
+            break;
+    }
+}
+/**
+ * @brief Reads the i-th sample of a png row (16 bit samples are big endian)
+ *
+ * @tparam BitDepth 8 or 16
+ * @param row
+ * @param i
+ * @return std::uint32_t
+ */
+template <int BitDepth>
+inline std::uint32_t load_sample(const std::uint8_t* row, std::int64_t i) {
+    if constexpr (BitDepth == 16)
+        return (static_cast<std::uint32_t>(row[2 * i]) << 8) | row[2 * i + 1];
+    else
+        return row[i];
+}
+/**
+ * @brief Per channel affine map of the samples to the floating point outputs: sample * gain[c] + bias[c].
+ * Folds the normalization to [0, 1] with DecodeOptions::scale, mean and stddev so that the
+ * samples are normalized while they are converted.
+ */
+struct Normalization {
+    float gain[4];
+    float bias[4];
+};
+/**
+ * @brief Normalization of the decoded channels: (sample / max_sample * scale[c] - mean[c]) / stddev[c]
+ * Throws std::invalid_argument if DecodeOptions::scale, mean or stddev has neither 0, 1 nor channels values.
+ *
+ * @param options
+ * @param channels decoded channels
+ * @param bit_depth bit depth of the samples written to the output: 8 or 16
+ * @return Normalization
+ */
+Normalization make_normalization(const DecodeOptions& options, std::int64_t channels, int bit_depth) {
+    const auto check_size = [channels](const char* name, const std::vector<float>& values) {
+        const auto size = static_cast<std::int64_t>(values.size());
+        if (size > 1 && size != channels)
+            throw std::invalid_argument("Unexpected DecodeOptions::" + std::string(name) + " size.\nGot(" +
+                                        std::to_string(size) + "). Expects 0, 1 or " + std::to_string(channels) +
+                                        " (decoded channels).");
+    };
+    check_size("scale", options.scale);
+    check_size("mean", options.mean);
+    check_size("stddev", options.stddev);
+    // a single value applies to all the channels
+    const auto value = [](const std::vector<float>& values, std::int64_t c, float unset) {
+        return values.empty() ? unset : values[values.size() == 1 ? 0 : c];
+    };
+    const auto max_sample = static_cast<float>((1 << bit_depth) - 1);
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
-        abort();
+    Normalization normalization = {};
+    for (std::int64_t c = 0; c < channels; ++c) {
+        const auto stddev     = value(options.stddev, c, 1.f);
+        normalization.gain[c] = value(options.scale, c, 1.f) / (max_sample * stddev);
+        normalization.bias[c] = -value(options.mean, c, 0.f) / stddev;
     }
-    png_infop end_info = png_create_info_struct(png_ptr);
-    if (!end_info) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
-        abort();
+    return normalization;
+}
+/**
+ * @brief Converts a png sample of channel c to the output dtype:
+ * floats are normalized (see Normalization), torch::kUInt8 keeps the 8 most significant bits,
+ * torch::kInt16 keeps the bits (16 bit samples above 32767 wrap to negative values).
+ *
+ * @tparam T output type
+ * @tparam BitDepth 8 or 16
+ * @param value
+ * @param normalization
+ * @param c channel of the sample
+ * @return T
+ */
+template <typename T, int BitDepth>
+inline T convert_sample(std::uint32_t value, const Normalization& normalization, std::int64_t c) {
+    if constexpr (is_float_v<T>)
+        return static_cast<T>(static_cast<float>(value) * normalization.gain[c] + normalization.bias[c]);
+    else if constexpr (sizeof(T) == 1 && BitDepth == 16)
+        return static_cast<T>(value >> 8);
+    else
+        return static_cast<T>(value);
+}
+/**
+ * @brief Converts a decoded png row to the output, the byte swap and the conversion are fused in a single pass
+ *
+ * @tparam T output type
+ * @tparam BitDepth 8 or 16
+ * @param row png row {width, channels}
+ * @param out first element of the row in the output (first plane if not interleaved)
+ * @param width
+ * @param channels
+ * @param plane_stride number of elements between two consecutive planes of out, unused if interleaved
+ * @param interleaved whether out is {width, channels} (HWC) or {channels, width} (CHW)
+ * @param normalization of the floating point outputs
+ */
+template <typename T, int BitDepth>
+void convert_row(const std::uint8_t* __restrict row,
+                 T* __restrict out,
+                 std::int64_t         width,
+                 std::int64_t         channels,
+                 std::int64_t         plane_stride,
+                 bool                 interleaved,
+                 const Normalization& normalization) {
+    if (interleaved) {
+        for (std::int64_t x = 0; x < width; ++x)
+            for (std::int64_t c = 0; c < channels; ++c)
+                out[x * channels + c] =
+                    convert_sample<T, BitDepth>(load_sample<BitDepth>(row, x * channels + c), normalization, c);
+        return;
     }
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-        abort();
+    for (std::int64_t c = 0; c < channels; ++c) {
+        T* __restrict plane = out + c * plane_stride;
+        for (std::int64_t x = 0; x < width; ++x)
+            plane[x] = convert_sample<T, BitDepth>(load_sample<BitDepth>(row, x * channels + c), normalization, c);
     }
-    png_init_io(png_ptr, fp.get());
-    // lets libpng know there are some bytes missing (the 8 we read)
-    png_set_sig_bytes(png_ptr, 8);
-
-    // read all the file information up to the actual image data
-    png_read_info(png_ptr, info_ptr);
-
-    const auto height    = png_get_image_height(png_ptr, info_ptr);
-    const auto width     = png_get_image_width(png_ptr, info_ptr);
-    const auto channels  = png_get_channels(png_ptr, info_ptr);
-    const auto bit_depth = png_get_bit_depth(png_ptr, info_ptr);
-    // Currently handles only bit_depth 8
-    if (bit_depth != 8) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-        abort();
+}
+/**
+ * @brief Converts an element of an image tensor to a 16 bit png sample:
+ * floating point values (float, half, bfloat16) are expected in [0, 1], torch::kInt32 values are clamped
+ * to [0, 65535], torch::kInt16 bits are kept and torch::kUInt8 values are scaled to 16 bits.
+ *
+ * @tparam T
+ * @param value
+ * @return std::uint16_t
+ */
+template <typename T>
+inline std::uint16_t pack_sample(T value) {
+    if constexpr (is_float_v<T>) {
+        // NaN maps to 0
+        const auto x = static_cast<float>(value);
+        return static_cast<std::uint16_t>((x > 0.f ? (x < 1.f ? x : 1.f) : 0.f) * 65535.f + 0.5f);
+    } else if constexpr (sizeof(T) == 1) {
+        return static_cast<std::uint16_t>(value * 257);
+    } else if constexpr (sizeof(T) == 2) {
+        return static_cast<std::uint16_t>(value);
+    } else {
+        return static_cast<std::uint16_t>(value > 0 ? (value < 65535 ? value : 65535) : 0);
     }
-    png_read_update_info(png_ptr, info_ptr);
-    // read file
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-        abort();
+}
+/**
+ * @brief Interleaves a row of planes of any strides into a row of big endian 16 bit samples
+ *
+ * @tparam T
+ * @param planes first element of the row in the first plane
+ * @param row {width, channels} 16 bit samples
+ * @param width
+ * @param plane_stride
+ * @param pixel_stride
+ * @param channels
+ */
+template <typename T>
+void pack_row(const T* __restrict planes,
+              std::uint8_t* __restrict row,
+              std::int64_t width,
+              std::int64_t plane_stride,
+              std::int64_t pixel_stride,
+              std::int64_t channels) {
+    for (std::int64_t x = 0; x < width; ++x) {
+        for (std::int64_t c = 0; c < channels; ++c) {
+            const auto value = pack_sample(planes[c * plane_stride + x * pixel_stride]);
+            const auto i     = 2 * (x * channels + c);
+            row[i]           = static_cast<std::uint8_t>(value >> 8);
+            row[i + 1]       = static_cast<std::uint8_t>(value);
+        }
     }
+}
+/**
+ * @brief Interleaved png rows of a cpu tensor with dims {channels, height, width} and any strides.
+ * torch::kUInt8 tensors give 8 bit rows, the other dtypes 16 bit rows (see pack_sample).
+ * torch::kUInt8 rows whose pixels are already interleaved in memory (e.g. a permuted contiguous HWC tensor)
+ * are returned without any copy, other rows are interleaved in the buffer given by the caller.
+ */
+class InterleavedRows {
+  public:
+    explicit InterleavedRows(const torch::Tensor& tensor)
+      : tensor_{tensor},
+        data_{tensor.scalar_type() == torch::kUInt8 ? tensor.data_ptr<std::uint8_t>() : NULL},
+        bit_depth_{data_ ? 8 : 16},
+        channels_{tensor.size(0)},
+        width_{tensor.size(2)},
+        plane_stride_{tensor.stride(0)},
+        row_stride_{tensor.stride(1)},
+        pixel_stride_{tensor.stride(2)},
+        interleaved_{data_ && pixel_stride_ == channels_ && (channels_ == 1 || plane_stride_ == 1)} {}
+    /**
+     * @brief true if the rows are returned without copy (no buffer needed)
+     */
+    bool interleaved() const { return interleaved_; }
+    /**
+     * @brief bit depth of the png samples: 8 or 16
+     */
+    int bit_depth() const { return bit_depth_; }
+    /**
+     * @brief number of bytes of a pixel
+     */
+    std::int64_t pixelbytes() const { return channels_ * bit_depth_ / 8; }
+    /**
+     * @brief number of bytes of a row: width * pixelbytes()
+     */
+    std::int64_t rowbytes() const { return width_ * pixelbytes(); }
+    /**
+     * @brief Interleaved pixels of the row y
+     *
+     * @param y
+     * @param buffer rowbytes() bytes, unused if interleaved()
+     * @return const std::uint8_t* either a pointer in the tensor or buffer
+     */
+    const std::uint8_t* row(std::int64_t y, std::uint8_t* buffer) const {
+        if (interleaved_)
+            return data_ + y * row_stride_;
 
-    auto options      = torch::TensorOptions().dtype(torch::kUInt8).device(torch::kCPU);
-    auto torch_tensor = torch::empty({height, width, channels}, options).contiguous();
-
-    for (std::int64_t offset = 0; offset < height * width * channels; offset += width * channels)
-        png_read_row(png_ptr, (torch_tensor.data_ptr<std::uint8_t>() + offset), NULL);
+        TORCH_PNG_STAGE_SCOPE(convert_scope, Convert, rowbytes());
+        if (data_) {
+            interleave_row(data_ + y * row_stride_, buffer, width_, plane_stride_, pixel_stride_, channels_);
+        } else {
+            dispatch_dtype(tensor_.scalar_type(), [&](auto sample) {
+                using T = decltype(sample);
+                pack_row(tensor_.data_ptr<T>() + y * row_stride_, buffer, width_, plane_stride_, pixel_stride_,
+                         channels_);
+            });
+        }
+        return buffer;
+    }
 
-    png_read_end(png_ptr, end_info);
+  private:
+    torch::Tensor       tensor_;
+    const std::uint8_t* data_;
+    int                 bit_depth_;
+    std::int64_t        channels_;
+    std::int64_t        width_;
+    std::int64_t        plane_stride_;
+    std::int64_t        row_stride_;
+    std::int64_t        pixel_stride_;
+    bool                interleaved_;
+};
+/**
+ * @brief Buffer that libpng reads from through read_from_memory.
+ * The bytes are not owned nor copied, only the read offset advances.
+ */
+struct MemoryReader {
+    const std::uint8_t* data;
+    std::size_t         size;
+    std::size_t         offset;
+};
+/**
+ * @brief libpng read callback feeding the decoder from a MemoryReader
+ *
+ * @param png_ptr png struct whose io_ptr is a MemoryReader
+ * @param out destination requested by libpng
+ * @param length number of bytes requested by libpng
+ */
+void read_from_memory(png_structp png_ptr, png_bytep out, png_size_t length) {
+    auto* reader = static_cast<MemoryReader*>(png_get_io_ptr(png_ptr));
 
-    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+    if (reader->size - reader->offset < length)
+        png_error(png_ptr, "Read past the end of the png buffer");
 
-    return torch_tensor.permute({2, 0, 1}).contiguous();
+    std::memcpy(out, reader->data + reader->offset, length);
+    reader->offset += length;
 }
+/**
+ * @brief Dims of a decoded image w.r.t. the requested layout
+ *
+ * @param height
+ * @param width
+ * @param channels
+ * @param layout
+ * @return std::vector<std::int64_t> {channels, height, width} or {height, width, channels}
+ */
+std::vector<std::int64_t> image_dims(std::int64_t height, std::int64_t width, std::int64_t channels, Layout layout) {
+    if (layout == Layout::HWC)
+        return {height, width, channels};
+    return {channels, height, width};
+}
+/**
+ * @brief Infos of the IHDR chunk (and whether a tRNS chunk precedes the image data)
+ */
+struct PngHeader {
+    std::int32_t height;
+    std::int32_t width;
+    std::uint8_t channels;
+    std::uint8_t bit_depth;
+    std::uint8_t color_type;
+    bool         has_trns;
+};
+/**
+ * @brief Reads the chunks of a png buffer up to the image data
+ *
+ * @param source reported in the errors
+ * @param data png bytes, signature checked
+ * @param size
+ * @return PngHeader
+ */
+PngHeader read_header(const std::string& source, const std::uint8_t* data, std::size_t size) {
+    // the signature has already been checked so libpng starts reading right after it
+    MemoryReader reader{data, size, 8};
 
-void encode(const fs::path& filepath, const torch::Tensor& tensor) {
-    auto tensor_cpy = check_transform_cpy(tensor);
+    ReadStructs png(source, NULL);
+    const auto  png_ptr  = png.png_ptr;
+    const auto  info_ptr = png.info_ptr;
+    // libpng errors longjmp here
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw DecodeError(source, png.error.message);
 
-    auto fp = make_unique_fp(filepath.c_str(), "wb");
-    if (!fp.get())
-        abort();
+    png_set_read_fn(png_ptr, &reader, read_from_memory);
+    // lets libpng know there are some bytes missing (the 8 we read)
+    png_set_sig_bytes(png_ptr, 8);
+    // read all the file information up to the actual image data
+    TORCH_PNG_STAGE_START(header_start);
+    png_read_info(png_ptr, info_ptr);
+    TORCH_PNG_STAGE_END(Header, header_start, 0);
 
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr)
-        abort();
+    PngHeader header;
+    header.height     = png_get_image_height(png_ptr, info_ptr);
+    header.width      = png_get_image_width(png_ptr, info_ptr);
+    header.channels   = png_get_channels(png_ptr, info_ptr);
+    header.bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
+    header.color_type = png_get_color_type(png_ptr, info_ptr);
+    header.has_trns   = png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
 
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr) {
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        abort();
+    return header;
+}
+/**
+ * @brief Reads the chunks of a png file up to the image data
+ *
+ * @param filepath
+ * @return PngHeader
+ */
+PngHeader read_header(const fs::path& filepath) {
+    TORCH_PNG_STAGE_START(io_start);
+    const InputFile file(filepath);
+    TORCH_PNG_STAGE_END(IO, io_start, file.size());
+    check_signature(filepath, file);
+
+    return read_header(filepath.string(), file.data(), file.size());
+}
+/**
+ * @brief Big endian 32 bits integer of the png chunks
+ */
+inline std::uint32_t load_uint32(const std::uint8_t* bytes) {
+    return (std::uint32_t(bytes[0]) << 24) | (std::uint32_t(bytes[1]) << 16) | (std::uint32_t(bytes[2]) << 8) |
+           std::uint32_t(bytes[3]);
+}
+/**
+ * @brief Reads the signature and the IHDR chunk of a png buffer (its first 33 bytes), without libpng.
+ * The fields are checked like libpng does but the CRC and the following chunks are not read.
+ *
+ * @param source reported in the errors
+ * @param bytes
+ * @param size
+ * @return PngHeader has_trns is always false (the chunks after IHDR are unknown)
+ */
+PngHeader probe_header(const std::string& source, const std::uint8_t* bytes, std::size_t size) {
+    if (!bytes || size < 8 || png_sig_cmp(bytes, 0, 8))
+        throw DecodeError(source, "Not a png file.");
+    // signature (8), IHDR length (4) and type (4), then the IHDR data (13)
+    if (size < 8 + 4 + 4 + 13 || load_uint32(bytes + 8) != 13 || std::memcmp(bytes + 12, "IHDR", 4))
+        throw DecodeError(source, "Missing IHDR chunk.");
+
+    const auto width      = load_uint32(bytes + 16);
+    const auto height     = load_uint32(bytes + 20);
+    const auto bit_depth  = bytes[24];
+    const auto color_type = bytes[25];
+    // same limits as png_check_IHDR (without the user limits)
+    if (!width || !height || width > PNG_UINT_31_MAX || height > PNG_UINT_31_MAX)
+        throw DecodeError(source, "Invalid image dims in IHDR.");
+    if (bytes[26] != PNG_COMPRESSION_TYPE_BASE || bytes[27] != PNG_FILTER_TYPE_BASE ||
+        bytes[28] >= PNG_INTERLACE_LAST)
+        throw DecodeError(source, "Unknown compression, filter or interlace method in IHDR.");
+
+    std::uint8_t channels = 0;
+    bool         valid    = false;
+    switch (color_type) {
+        case PNG_COLOR_TYPE_GRAY:
+            channels = 1;
+            valid    = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8 || bit_depth == 16;
+            break;
+        case PNG_COLOR_TYPE_PALETTE:
+            channels = 1;
+            valid    = bit_depth == 1 || bit_depth == 2 || bit_depth == 4 || bit_depth == 8;
+            break;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            channels = 2;
+            valid    = bit_depth == 8 || bit_depth == 16;
+            break;
+        case PNG_COLOR_TYPE_RGB:
+            channels = 3;
+            valid    = bit_depth == 8 || bit_depth == 16;
+            break;
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            channels = 4;
+            valid    = bit_depth == 8 || bit_depth == 16;
+            break;
     }
-    if (setjmp(png_jmpbuf(png_ptr))) {
-        png_destroy_write_struct(&png_ptr, &info_ptr);
-        abort();
+    if (!valid)
+        throw DecodeError(source, "Invalid color type and bit depth in IHDR.");
+
+    PngHeader header;
+    header.height     = static_cast<std::int32_t>(height);
+    header.width      = static_cast<std::int32_t>(width);
+    header.channels   = channels;
+    header.bit_depth  = bit_depth;
+    header.color_type = color_type;
+    header.has_trns   = false;
+
+    return header;
+}
+/**
+ * @brief Reads the signature and the IHDR chunk of a png file (its first 33 bytes), see probe_header
+ *
+ * @param filepath
+ * @return PngHeader has_trns is always false (the chunks after IHDR are unknown)
+ */
+PngHeader probe_header(const fs::path& filepath) {
+    TORCH_PNG_STAGE_SCOPE(probe_scope, Header, 0);
+    // signature (8), IHDR length (4) and type (4), then the IHDR data (13)
+    constexpr std::size_t size = 8 + 4 + 4 + 13;
+    std::uint8_t          bytes[size];
+    std::size_t           offset = 0;
+
+    TORCH_PNG_STAGE_START(io_start);
+    const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw DecodeError(filepath.string(), std::string("Cannot open file. ") + std::strerror(errno));
+    int error = 0;
+    while (offset < size) {
+        const auto count = read(fd, bytes + offset, size - offset);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            error = errno;
+        if (count <= 0)
+            break;
+        offset += static_cast<std::size_t>(count);
     }
-    png_init_io(png_ptr, fp.get());
-    /* write header */
+    close(fd);
+    TORCH_PNG_STAGE_END(IO, io_start, offset);
+
+    if (error)
+        throw DecodeError(filepath.string(), std::string("Cannot read file. ") + std::strerror(error));
+
+    return probe_header(filepath.string(), bytes, offset);
+}
+/**
+ * @brief Rectangle of the image to decode: rows [y0, y0 + height), columns [x0, x0 + width)
+ */
+struct Region {
+    std::int64_t y0;
+    std::int64_t x0;
+    std::int64_t height;
+    std::int64_t width;
+};
+/**
+ * @brief Writes the requested columns of an interleaved row of 8 or 16 bit samples to a row of the output
+ *
+ * @tparam T output type
+ * @param pixels interleaved row of the png
+ * @param bit_depth 8 or 16
+ * @param out first element of the row in the output (first plane if not interleaved)
+ * @param x0 first column
+ * @param width number of columns
+ * @param channels
+ * @param plane_stride number of elements between two consecutive planes of out, unused if interleaved
+ * @param interleaved whether out is {width, channels} (HWC) or {channels, width} (CHW)
+ * @param normalization of the floating point outputs
+ */
+template <typename T>
+void write_row(const std::uint8_t*  pixels,
+               int                  bit_depth,
+               T*                   out,
+               std::int64_t         x0,
+               std::int64_t         width,
+               std::int64_t         channels,
+               std::int64_t         plane_stride,
+               bool                 interleaved,
+               const Normalization& normalization) {
+    if (bit_depth == 16) {
+        convert_row<T, 16>(pixels + 2 * x0 * channels, out, width, channels, plane_stride, interleaved, normalization);
+    } else if constexpr (std::is_same_v<T, std::uint8_t>) {
+        if (interleaved)
+            std::memcpy(out, pixels + x0 * channels, width * channels);
+        else
+            deinterleave_row(pixels + x0 * channels, out, width, plane_stride, channels);
+    } else {
+        convert_row<T, 8>(pixels + x0 * channels, out, width, channels, plane_stride, interleaved, normalization);
+    }
+}
+/**
+ * @brief Writes every in_step-th pixel of an interleaved row of samples to every out_step-th pixel of a row of
+ * the output. Used by the subsampled decodes.
+ *
+ * @tparam T output type
+ * @tparam BitDepth 8 or 16
+ * @param pixels interleaved row of the png
+ * @param in_first first pixel read
+ * @param in_step
+ * @param out first pixel written (first plane if not interleaved)
+ * @param out_step
+ * @param count number of pixels
+ * @param channels
+ * @param plane_stride number of elements between two consecutive planes of out, unused if interleaved
+ * @param interleaved whether out is {width, channels} (HWC) or {channels, width} (CHW)
+ * @param normalization of the floating point outputs
+ */
+template <typename T, int BitDepth>
+void gather_row(const std::uint8_t* __restrict pixels,
+                std::int64_t in_first,
+                std::int64_t in_step,
+                T* __restrict out,
+                std::int64_t         out_step,
+                std::int64_t         count,
+                std::int64_t         channels,
+                std::int64_t         plane_stride,
+                bool                 interleaved,
+                const Normalization& normalization) {
+    const auto out_channel_stride = interleaved ? 1 : plane_stride;
+    const auto out_pixel_stride   = interleaved ? channels * out_step : out_step;
+
+    for (std::int64_t i = 0; i < count; ++i)
+        for (std::int64_t c = 0; c < channels; ++c)
+            out[i * out_pixel_stride + c * out_channel_stride] = convert_sample<T, BitDepth>(
+                load_sample<BitDepth>(pixels, (in_first + i * in_step) * channels + c), normalization, c);
+}
+/**
+ * @brief Dispatches gather_row w.r.t. the bit depth of the samples (8 or 16)
+ */
+template <typename T>
+void gather_row(const std::uint8_t*  pixels,
+                int                  bit_depth,
+                std::int64_t         in_first,
+                std::int64_t         in_step,
+                T*                   out,
+                std::int64_t         out_step,
+                std::int64_t         count,
+                std::int64_t         channels,
+                std::int64_t         plane_stride,
+                bool                 interleaved,
+                const Normalization& normalization) {
+    if (bit_depth == 16)
+        gather_row<T, 16>(
+            pixels, in_first, in_step, out, out_step, count, channels, plane_stride, interleaved, normalization);
+    else
+        gather_row<T, 8>(
+            pixels, in_first, in_step, out, out_step, count, channels, plane_stride, interleaved, normalization);
+}
+/**
+ * @brief Adds the samples of the columns [x0, x0 + width) of a row to the sums of their factor x factor blocks
+ *
+ * @tparam BitDepth 8 or 16
+ * @param pixels interleaved row of the png
+ * @param accumulator {scaled_size(width, factor), channels} sums
+ * @param x0
+ * @param width
+ * @param factor
+ * @param channels
+ */
+template <int BitDepth>
+void accumulate_row(const std::uint8_t* __restrict pixels,
+                    std::uint32_t* __restrict accumulator,
+                    std::int64_t x0,
+                    std::int64_t width,
+                    std::int64_t factor,
+                    std::int64_t channels) {
+    for (std::int64_t x = 0; x < width; ++x)
+        for (std::int64_t c = 0; c < channels; ++c)
+            accumulator[(x / factor) * channels + c] += load_sample<BitDepth>(pixels, (x0 + x) * channels + c);
+}
+/**
+ * @brief Writes the averages of the blocks of a downscaled row (box filter).
+ * Blocks on the right edge have factor - (width % factor) columns less.
+ *
+ * @tparam T output type
+ * @tparam BitDepth 8 or 16
+ * @param accumulator {scaled_size(width, factor), channels} sums
+ * @param rows number of rows summed (less than factor on the bottom edge)
+ * @param out first element of the row in the output (first plane if not interleaved)
+ * @param width number of columns of the full resolution region
+ * @param factor
+ * @param channels
+ * @param plane_stride number of elements between two consecutive planes of out, unused if interleaved
+ * @param interleaved whether out is {width, channels} (HWC) or {channels, width} (CHW)
+ * @param normalization of the floating point outputs
+ */
+template <typename T, int BitDepth>
+void write_box_row(const std::uint32_t* __restrict accumulator,
+                   std::int64_t rows,
+                   T* __restrict out,
+                   std::int64_t         width,
+                   std::int64_t         factor,
+                   std::int64_t         channels,
+                   std::int64_t         plane_stride,
+                   bool                 interleaved,
+                   const Normalization& normalization) {
+    const auto out_channel_stride = interleaved ? 1 : plane_stride;
+    const auto out_pixel_stride   = interleaved ? channels : 1;
+
+    for (std::int64_t x = 0; x < scaled_size(width, factor); ++x) {
+        const auto count = static_cast<std::uint32_t>(rows * std::min(factor, width - x * factor));
+
+        for (std::int64_t c = 0; c < channels; ++c) {
+            const auto sum = accumulator[x * channels + c];
+            T          value;
+            // floats keep the fractional part of the average
+            if constexpr (is_float_v<T>)
+                value = static_cast<T>(static_cast<float>(sum) / static_cast<float>(count) * normalization.gain[c] +
+                                       normalization.bias[c]);
+            else
+                value = convert_sample<T, BitDepth>((sum + count / 2) / count, normalization, c);
+            out[x * out_pixel_stride + c * out_channel_stride] = value;
+        }
+    }
+}
+/**
+ * @brief Number of Adam7 passes whose pixels all lie on the grid of a subsampled decode (factor 2, 4 or 8)
+ *
+ * @param factor
+ * @return int
+ */
+int adam7_subsample_passes(int factor) {
+    return factor == 8 ? 1 : factor == 4 ? 3 : 5;
+}
+/**
+ * @brief Width of the blocks of an Adam7 png once its first passes are decoded: each decoded pixel is the top left
+ * pixel of a block_width x block_height block (8 x 8 after the first pass, 1 x 1 after the seventh)
+ *
+ * @param passes number of passes decoded, 1 to 7
+ * @return std::int64_t
+ */
+std::int64_t adam7_block_width(int passes) {
+    static constexpr std::int64_t widths[7] = {8, 4, 4, 2, 2, 1, 1};
+    return widths[passes - 1];
+}
+/**
+ * @brief Height of the blocks of an Adam7 png once its first passes are decoded, see adam7_block_width
+ */
+std::int64_t adam7_block_height(int passes) {
+    static constexpr std::int64_t heights[7] = {8, 8, 4, 4, 2, 2, 1};
+    return heights[passes - 1];
+}
+/**
+ * @brief Adds a pixel to the sums of the blocks of the columns [x_first, x_end) of a downscaled row
+ *
+ * @tparam BitDepth 8 or 16
+ * @param pixels interleaved row of the png
+ * @param i index of the pixel in pixels
+ * @param accumulator {scaled_size(width, factor), channels} sums
+ * @param x_first
+ * @param x_end
+ * @param factor
+ * @param channels
+ */
+template <int BitDepth>
+void accumulate_pixel(const std::uint8_t* __restrict pixels,
+                      std::int64_t i,
+                      std::uint32_t* __restrict accumulator,
+                      std::int64_t x_first,
+                      std::int64_t x_end,
+                      std::int64_t factor,
+                      std::int64_t channels) {
+    for (std::int64_t x = x_first; x < x_end; ++x)
+        for (std::int64_t c = 0; c < channels; ++c)
+            accumulator[(x / factor) * channels + c] += load_sample<BitDepth>(pixels, i * channels + c);
+}
+/**
+ * @brief Infos of the png being decoded, read by the backend (libpng or libspng) before the rows
+ */
+struct ImageInfo {
+    std::int64_t height;
+    std::int64_t width;
+    int          bit_depth;
+    int          color_type;
+    // channels of the decoded image, see decoded_channels
+    std::int64_t channels;
+    // bytes of a png row as returned by the backend (samples packed, 16 bit samples big endian)
+    std::size_t rowbytes;
+    bool        interlaced;
+};
+/**
+ * @brief Whether the samples of a png are unpacked and looked up in a Palette
+ */
+bool expands(int color_type, int bit_depth) {
+    return color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8;
+}
+/**
+ * @brief Decodes the rows of a png, whatever the backend, in the tensor provided by allocate.
+ * The output tensor is provided by allocate once the header has been read. It may be a view
+ * (e.g. a slice of a batch) as long as the pixels of a row are contiguous within each plane.
+ * When a region is given, only its rows and columns are written to the output
+ * and the rows below it are never read.
+ * Downscaled decodes (DecodeOptions::scale_factor) reduce the rows as they come out of the backend, in a single
+ * accumulator row for the box filter. Adam7 pngs are read pass by pass and their pixels scattered to the output
+ * (the box filter then sums the whole output). Only DecodeOptions::adam7_passes passes are read, and subsampled
+ * Adam7 pngs only read the passes holding the sampled pixels.
+ * libpng may longjmp out of read_row: the locals alive across a read_row call must be trivially destructible
+ * and the output is returned through torch_tensor (owned by the caller).
+ *
+ * @tparam ReadRow callable with signature void(png_bytep row), reads the next row (of the current Adam7 pass)
+ * @tparam Allocate callable with signature torch::Tensor(std::int64_t height, std::int64_t width, std::int64_t
+ * channels, torch::Dtype dtype)
+ * @param image
+ * @param palette lookup table of the samples, read by the backend if expands(color_type, bit_depth)
+ * @param read_row
+ * @param decode_options
+ * @param allocate returns the output of type dtype with dims {channels, height, width} or {height, width, channels}
+ * @param workspace row buffers
+ * @param region part of the image to decode, NULL decodes the whole image
+ * @param torch_tensor set to the tensor returned by allocate, filled with the decoded image
+ * @return bool whether all the rows have been read (the backend may then check the end of the png)
+ */
+template <typename ReadRow, typename Allocate>
+bool decode_rows(const ImageInfo&     image,
+                 const Palette&       palette,
+                 ReadRow&&            read_row,
+                 const DecodeOptions& decode_options,
+                 Allocate&&           allocate,
+                 Workspace&           workspace,
+                 const Region*        region,
+                 torch::Tensor&       torch_tensor) {
+    const std::int64_t height     = image.height;
+    const std::int64_t width      = image.width;
+    const int          bit_depth  = image.bit_depth;
+    const int          color_type = image.color_type;
+    const std::int64_t channels   = image.channels;
+    auto&              row         = workspace.row;
+    auto&              expanded    = workspace.expanded;
+    auto&              accumulator = workspace.accumulator;
+
+    const auto   dtype = output_dtype(decode_options, bit_depth);
+    const Region roi   = region ? *region : Region{0, 0, height, width};
+
+    if (roi.y0 + roi.height > height || roi.x0 + roi.width > width)
+        throw std::invalid_argument("Unexpected region (" + std::to_string(roi.y0) + ", " + std::to_string(roi.x0) +
+                                    ", " + std::to_string(roi.height) + ", " + std::to_string(roi.width) +
+                                    "). Exceeds the image dims (" + std::to_string(height) + ", " +
+                                    std::to_string(width) + ").");
+    // palette and sub-byte samples are unpacked and looked up in a table, then written like 8 bit samples
+    const bool expand = color_type == PNG_COLOR_TYPE_PALETTE || bit_depth < 8;
+    if (expand && color_type == PNG_COLOR_TYPE_PALETTE && decode_options.palette_indices && is_float_dtype(dtype))
+        throw std::invalid_argument("Unexpected DecodeOptions::dtype. Palette indices expect an integer type.");
+    const std::int64_t factor      = decode_options.scale_factor;
+    const bool         subsample   = factor > 1 && decode_options.downscale == Downscale::Subsample;
+    const bool         interlaced  = image.interlaced;
+    const int          passes      = decode_options.adam7_passes;
+    const bool         early_adam7 = interlaced && subsample && roi.y0 % factor == 0 && roi.x0 % factor == 0 &&
+                                     adam7_subsample_passes(factor) <= passes;
+
+    torch_tensor = allocate(scaled_size(roi.height, factor), scaled_size(roi.width, factor), channels, dtype);
+
+    const bool interleaved  = decode_options.layout == Layout::HWC;
+    const auto row_stride   = torch_tensor.stride(interleaved ? 0 : 1);
+    const auto plane_stride = interleaved ? 1 : torch_tensor.stride(0);
+    // 8 bit outputs whose rows are laid out as the (expanded) png rows are written in place
+    const bool in_place = dtype == torch::kUInt8 && bit_depth <= 8 && factor == 1 && !interlaced && roi.x0 == 0 &&
+                          roi.width == width && (interleaved || channels == 1);
+    // bit depth of the samples written to the output
+    const int  sample_depth  = expand ? 8 : bit_depth;
+    const auto normalization = make_normalization(decode_options, channels, sample_depth);
+
+    row.resize(image.rowbytes);
+    expanded.resize(expand && !in_place ? width * channels : 0);
+
+    if (interlaced) {
+        // the passes are read one after the other, their pixels are scattered to the output
+        const int          pass_count   = early_adam7 ? adam7_subsample_passes(factor) : passes;
+        const std::int64_t block_width  = adam7_block_width(pass_count);
+        const std::int64_t block_height = adam7_block_height(pass_count);
+        // each pixel read is a single output pixel: either all the passes are read, or the pixels of the first
+        // passes are exactly the top left pixels of the subsampled blocks
+        const bool         strided      = early_adam7 || (factor == 1 && pass_count == 7);
+        const std::int64_t out_width    = scaled_size(roi.width, factor);
+        const std::int64_t out_pixel    = interleaved ? channels : 1;
+
+        if (factor > 1 && !subsample)
+            accumulator.assign(scaled_size(roi.height, factor) * out_width * channels, 0);
+
+        dispatch_dtype(dtype, [&](auto sample) {
+            using T    = decltype(sample);
+            auto* data = torch_tensor.data_ptr<T>();
+
+            for (int pass = 0; pass < pass_count; ++pass) {
+                const std::int64_t pass_rows = PNG_PASS_ROWS(height, pass);
+                const std::int64_t pass_cols = PNG_PASS_COLS(width, pass);
+                // libpng skips the empty passes
+                if (!pass_rows || !pass_cols)
+                    continue;
+
+                const std::int64_t x_step    = std::int64_t(1) << PNG_PASS_COL_SHIFT(pass);
+                const std::int64_t x_start   = PNG_PASS_START_COL(pass);
+                // columns [col_first, col_end) of the pass lie in the region
+                const std::int64_t col_first = std::max<std::int64_t>(0, (roi.x0 - x_start + x_step - 1) / x_step);
+                const std::int64_t col_end =
+                    std::min<std::int64_t>(pass_cols, (roi.x0 + roi.width - x_start + x_step - 1) / x_step);
+
+                for (std::int64_t r = 0; r < pass_rows; ++r) {
+                    read_row(row.data());
+
+                    const std::int64_t y = PNG_ROW_FROM_PASS_ROW(r, pass) - roi.y0;
+                    // rows [y_first, y_end) of the region covered by the blocks of the row
+                    const std::int64_t y_first = std::max<std::int64_t>(y, 0);
+                    const std::int64_t y_end   = std::min<std::int64_t>(y + (strided ? 1 : block_height), roi.height);
+                    if (y_first >= y_end)
+                        continue;
+
+                    TORCH_PNG_STAGE_SCOPE(convert_scope, Convert, row.size());
+
+                    const std::uint8_t* pixels = row.data();
+                    if (expand) {
+                        expand_row(row.data(), expanded.data(), pass_cols, bit_depth, palette);
+                        pixels = expanded.data();
+                    }
+                    if (strided) {
+                        if (col_end <= col_first)
+                            continue;
+                        const std::int64_t x = PNG_COL_FROM_PASS_COL(col_first, pass) - roi.x0;
+                        gather_row(pixels, sample_depth, col_first, 1,
+                                   data + (y / factor) * row_stride + (x / factor) * out_pixel, x_step / factor,
+                                   col_end - col_first, channels, plane_stride, interleaved, normalization);
+                        continue;
+                    }
+                    // progressive display: the pixel is replicated over its block, which is then downscaled
+                    for (std::int64_t col = 0; col < pass_cols; ++col) {
+                        const std::int64_t x       = PNG_COL_FROM_PASS_COL(col, pass) - roi.x0;
+                        const std::int64_t x_first = std::max<std::int64_t>(x, 0);
+                        const std::int64_t x_end   = std::min<std::int64_t>(x + block_width, roi.width);
+                        if (x_first >= x_end)
+                            continue;
+
+                        if (factor > 1 && !subsample) {
+                            for (std::int64_t yb = y_first; yb < y_end; ++yb) {
+                                auto* sums = accumulator.data() + (yb / factor) * out_width * channels;
+                                if (sample_depth == 16)
+                                    accumulate_pixel<16>(pixels, col, sums, x_first, x_end, factor, channels);
+                                else
+                                    accumulate_pixel<8>(pixels, col, sums, x_first, x_end, factor, channels);
+                            }
+                            continue;
+                        }
+                        // only the first (sampled) row of the block is written, the others are copied below.
+                        // Subsampling only keeps the top left pixel of the blocks
+                        const std::int64_t y_sampled = (y_first + factor - 1) / factor * factor;
+                        const std::int64_t x_sampled = (x_first + factor - 1) / factor * factor;
+                        if (y_sampled >= y_end || x_sampled >= x_end)
+                            continue;
+                        gather_row(pixels, sample_depth, col, 0,
+                                   data + (y_sampled / factor) * row_stride + (x_sampled / factor) * out_pixel, 1,
+                                   scaled_size(x_end - x_sampled, factor), channels, plane_stride, interleaved,
+                                   normalization);
+                    }
+                }
+            }
+            if (strided)
+                return;
+            if (factor == 1 || subsample) {
+                // the rows of the blocks are copies of their first written row
+                const std::int64_t planes = interleaved ? 1 : channels;
+                const std::int64_t count  = interleaved ? out_width * channels : out_width;
+                for (std::int64_t y = 0; y < scaled_size(roi.height, factor); ++y) {
+                    const std::int64_t block_y =
+                        std::max<std::int64_t>((y * factor + roi.y0) / block_height * block_height - roi.y0, 0);
+                    const std::int64_t first = (block_y + factor - 1) / factor;
+                    if (first == y)
+                        continue;
+                    for (std::int64_t c = 0; c < planes; ++c)
+                        std::copy_n(data + first * row_stride + c * plane_stride, count,
+                                    data + y * row_stride + c * plane_stride);
+                }
+                return;
+            }
+            // averages of the blocks, once all their pixels are known
+            for (std::int64_t y = 0; y < scaled_size(roi.height, factor); ++y) {
+                const auto  rows = std::min(factor, roi.height - y * factor);
+                const auto* sums = accumulator.data() + y * out_width * channels;
+                if (sample_depth == 16)
+                    write_box_row<T, 16>(sums, rows, data + y * row_stride, roi.width, factor, channels, plane_stride,
+                                         interleaved, normalization);
+                else
+                    write_box_row<T, 8>(sums, rows, data + y * row_stride, roi.width, factor, channels, plane_stride,
+                                        interleaved, normalization);
+            }
+        });
+        // the passes after pass_count are never read
+        return pass_count == 7;
+    }
+    if (factor > 1 && !subsample)
+        accumulator.assign(scaled_size(roi.width, factor) * channels, 0);
+    // the rows above the region have to be decoded, they are dropped
+    for (std::int64_t y = 0; y < roi.y0; ++y)
+        read_row(row.data());
+
+    dispatch_dtype(dtype, [&](auto sample) {
+        using T    = decltype(sample);
+        auto* data = torch_tensor.data_ptr<T>();
+
+        for (std::int64_t y = 0; y < roi.height; ++y) {
+            T* out = data + (y / factor) * row_stride;
+
+            if constexpr (std::is_same_v<T, std::uint8_t>) {
+                if (in_place && !expand) {
+                    read_row(out);
+                    continue;
+                }
+            }
+            read_row(row.data());
+            // subsampling only keeps the first row of the blocks
+            if (subsample && y % factor)
+                continue;
+
+            TORCH_PNG_STAGE_SCOPE(convert_scope, Convert, row.size());
+
+            const std::uint8_t* pixels = row.data();
+            if (expand) {
+                if constexpr (std::is_same_v<T, std::uint8_t>) {
+                    if (in_place) {
+                        expand_row(row.data(), out, width, bit_depth, palette);
+                        continue;
+                    }
+                }
+                expand_row(row.data(), expanded.data(), width, bit_depth, palette);
+                pixels = expanded.data();
+            }
+            if (factor == 1) {
+                write_row(pixels, sample_depth, out, roi.x0, roi.width, channels, plane_stride, interleaved,
+                          normalization);
+            } else if (subsample) {
+                gather_row(pixels, sample_depth, roi.x0, factor, out, 1, scaled_size(roi.width, factor), channels,
+                           plane_stride, interleaved, normalization);
+            } else {
+                if (sample_depth == 16)
+                    accumulate_row<16>(pixels, accumulator.data(), roi.x0, roi.width, factor, channels);
+                else
+                    accumulate_row<8>(pixels, accumulator.data(), roi.x0, roi.width, factor, channels);
+                // the block is complete (or the last one)
+                if ((y + 1) % factor && y + 1 < roi.height)
+                    continue;
+
+                const auto rows = y % factor + 1;
+                if (sample_depth == 16)
+                    write_box_row<T, 16>(accumulator.data(), rows, out, roi.width, factor, channels, plane_stride,
+                                         interleaved, normalization);
+                else
+                    write_box_row<T, 8>(accumulator.data(), rows, out, roi.width, factor, channels, plane_stride,
+                                        interleaved, normalization);
+                std::fill(accumulator.begin(), accumulator.end(), 0);
+            }
+        }
+    });
+    // stops reading early, the rows below the region are never decoded
+    return roi.y0 + roi.height == height;
+}
+/**
+ * @brief Decodes a png whose 8 bytes signature has already been checked, with libpng.
+ * The input source is provided by init_io so that files and memory buffers share
+ * the same header parsing, validation and row reading logic.
+ * Errors are thrown as DecodeError.
+ *
+ * @tparam InitIO callable with signature void(png_structp)
+ * @tparam Allocate see decode_rows
+ * @param source file path (or description of the buffer) reported in the errors
+ * @param init_io sets the libpng input (png_init_io, png_set_read_fn, ...)
+ * @param decode_options
+ * @param allocate see decode_rows
+ * @param workspace libpng allocator and row buffers
+ * @param region see decode_rows
+ * @return torch::Tensor the tensor returned by allocate, filled with the decoded image
+ */
+template <typename InitIO, typename Allocate>
+torch::Tensor decode_png(const std::string&   source,
+                         InitIO&&             init_io,
+                         const DecodeOptions& decode_options,
+                         Allocate&&           allocate,
+                         Workspace&           workspace,
+                         const Region*        region = NULL) {
+    check_options(decode_options);
+
+    ReadStructs png(source, workspace.pool);
+    const auto  png_ptr  = png.png_ptr;
+    const auto  info_ptr = png.info_ptr;
+
+    torch::Tensor torch_tensor;
+    Palette       palette;
+    // libpng errors longjmp here
     if (setjmp(png_jmpbuf(png_ptr)))
-        abort();
+        throw DecodeError(source, png.error.message);
 
-    const auto height   = tensor_cpy.size(0);
-    const auto width    = tensor_cpy.size(1);
-    const auto channels = tensor_cpy.size(2);
+    init_io(png_ptr);
+    // lets libpng know there are some bytes missing (the 8 we read)
+    png_set_sig_bytes(png_ptr, 8);
+
+    // read all the file information up to the actual image data
+    TORCH_PNG_STAGE_START(header_start);
+    png_read_info(png_ptr, info_ptr);
+
+    ImageInfo image;
+    image.height     = png_get_image_height(png_ptr, info_ptr);
+    image.width      = png_get_image_width(png_ptr, info_ptr);
+    image.bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
+    image.color_type = png_get_color_type(png_ptr, info_ptr);
+    image.channels   = decoded_channels(image.color_type,
+                                      png_get_channels(png_ptr, info_ptr),
+                                      png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS),
+                                      decode_options);
+    image.interlaced = png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_ADAM7;
+
+    png_read_update_info(png_ptr, info_ptr);
+    image.rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    TORCH_PNG_STAGE_END(Header, header_start, 0);
+
+    if (expands(image.color_type, image.bit_depth))
+        read_palette(png_ptr, info_ptr, decode_options, palette);
+    // png_read_row, timed as inflate
+    const auto read_row = [&](png_bytep out) {
+        TORCH_PNG_STAGE_START(inflate_start);
+        png_read_row(png_ptr, out, NULL);
+        TORCH_PNG_STAGE_END(Inflate, inflate_start, image.rowbytes);
+    };
+    const bool complete = decode_rows(image,
+                                      palette,
+                                      read_row,
+                                      decode_options,
+                                      std::forward<Allocate>(allocate),
+                                      workspace,
+                                      region,
+                                      torch_tensor);
+    // checks the CRC of the last IDAT chunk (and the chunks after it) once the whole image has been read
+    if (complete)
+        png_read_end(png_ptr, png.end_info);
+
+    return torch_tensor;
+}
+#ifdef TORCH_PNG_SPNG
+/**
+ * @brief Number of samples per pixel of a png color type
+ */
+int png_channels(int color_type) {
+    switch (color_type) {
+        case PNG_COLOR_TYPE_RGB:
+            return 3;
+        case PNG_COLOR_TYPE_GRAY_ALPHA:
+            return 2;
+        case PNG_COLOR_TYPE_RGB_ALPHA:
+            return 4;
+        default:
+            return 1;
+    }
+}
+/**
+ * @brief Decodes a non interlaced png buffer with libspng, see decode_png.
+ * The rows are decoded in the png format (SPNG_FMT_RAW: packed samples, 16 bit samples big endian)
+ * so that they go through the same conversions as the rows of libpng.
+ * Errors are thrown as DecodeError.
+ *
+ * @tparam Allocate see decode_rows
+ * @param source file path (or description of the buffer) reported in the errors
+ * @param data png bytes, signature included
+ * @param size
+ * @param decode_options
+ * @param allocate see decode_rows
+ * @param workspace row buffers
+ * @param region see decode_rows
+ * @return torch::Tensor the tensor returned by allocate, filled with the decoded image
+ */
+template <typename Allocate>
+torch::Tensor decode_spng(const std::string&   source,
+                          const std::uint8_t*  data,
+                          std::size_t          size,
+                          const DecodeOptions& decode_options,
+                          Allocate&&           allocate,
+                          Workspace&           workspace,
+                          const Region*        region) {
+    check_options(decode_options);
+
+    const std::unique_ptr<spng_ctx, decltype(&spng_ctx_free)> ctx(spng_ctx_new(0), spng_ctx_free);
+    if (!ctx)
+        throw DecodeError(source, "Cannot create the spng context.");
+
+    const auto check = [&source](int ret) {
+        if (ret != SPNG_OK)
+            throw DecodeError(source, spng_strerror(ret));
+    };
+    check(spng_set_png_buffer(ctx.get(), data, size));
+
+    TORCH_PNG_STAGE_START(header_start);
+    spng_ihdr ihdr;
+    check(spng_get_ihdr(ctx.get(), &ihdr));
+
+    spng_plte plte;
+    spng_trns trns;
+    const bool has_plte = ihdr.color_type == SPNG_COLOR_TYPE_INDEXED && spng_get_plte(ctx.get(), &plte) == SPNG_OK;
+    const bool has_trns = spng_get_trns(ctx.get(), &trns) == SPNG_OK;
+
+    std::size_t image_size = 0;
+    check(spng_decoded_image_size(ctx.get(), SPNG_FMT_RAW, &image_size));
+    check(spng_decode_image(ctx.get(), NULL, 0, SPNG_FMT_RAW, SPNG_DECODE_PROGRESSIVE));
+
+    ImageInfo image;
+    image.height     = ihdr.height;
+    image.width      = ihdr.width;
+    image.bit_depth  = ihdr.bit_depth;
+    image.color_type = ihdr.color_type;
+    image.channels   = decoded_channels(image.color_type, png_channels(image.color_type), has_trns, decode_options);
+    image.rowbytes   = image_size / ihdr.height;
+    image.interlaced = ihdr.interlace_method != SPNG_INTERLACE_NONE;
+    TORCH_PNG_STAGE_END(Header, header_start, 0);
+
+    Palette palette;
+    if (expands(image.color_type, image.bit_depth)) {
+        fill_palette(image.color_type,
+                     image.bit_depth,
+                     decode_options,
+                     has_plte ? plte.entries : NULL,
+                     has_plte ? static_cast<int>(plte.n_entries) : 0,
+                     has_trns && has_plte ? trns.type3_alpha : NULL,
+                     has_trns && has_plte ? static_cast<int>(trns.n_type3_entries) : 0,
+                     palette);
+    }
+    // spng_decode_row, timed as inflate. The last row returns SPNG_EOI
+    const auto read_row = [&](png_bytep out) {
+        TORCH_PNG_STAGE_START(inflate_start);
+        const int ret = spng_decode_row(ctx.get(), out, image.rowbytes);
+        TORCH_PNG_STAGE_END(Inflate, inflate_start, image.rowbytes);
+        if (ret != SPNG_EOI)
+            check(ret);
+    };
+    torch::Tensor torch_tensor;
+    decode_rows(image,
+                palette,
+                read_row,
+                decode_options,
+                std::forward<Allocate>(allocate),
+                workspace,
+                region,
+                torch_tensor);
+    return torch_tensor;
+}
+#endif
+/**
+ * @brief Allocates a new cpu image w.r.t. the requested layout
+ *
+ * @param layout
+ * @return callable used as the allocate argument of decode_png
+ */
+auto allocate_image(Layout layout) {
+    return [layout](std::int64_t height, std::int64_t width, std::int64_t channels, torch::Dtype dtype) {
+        return torch::empty(image_dims(height, width, channels, layout),
+                            torch::TensorOptions().dtype(dtype).device(torch::kCPU));
+    };
+}
+/**
+ * @brief Decodes png bytes whose signature has been checked in the tensor provided by allocate
+ *
+ * @tparam Allocate see decode_png
+ * @param source reported in the errors
+ * @param data
+ * @param size
+ * @param options
+ * @param allocate
+ * @param workspace
+ * @param region see decode_png
+ * @return torch::Tensor
+ */
+template <typename Allocate>
+torch::Tensor decode_bytes(const std::string&   source,
+                           const std::uint8_t*  data,
+                           std::size_t          size,
+                           const DecodeOptions& options,
+                           Allocate&&           allocate,
+                           Workspace&           workspace,
+                           const Region*        region = NULL) {
+#ifdef TORCH_PNG_SPNG
+    // interlace method of the IHDR chunk (right after the signature), the Adam7 pngs are left to libpng
+    const std::size_t interlace_offset = 28;
+    if (size > interlace_offset && data[interlace_offset] == PNG_INTERLACE_NONE)
+        return decode_spng(source, data, size, options, std::forward<Allocate>(allocate), workspace, region);
+#endif
+    // the signature has already been checked so libpng starts reading right after it
+    MemoryReader reader{data, size, 8};
+
+    return decode_png(source,
+                      [&reader](png_structp png_ptr) { png_set_read_fn(png_ptr, &reader, read_from_memory); },
+                      options,
+                      std::forward<Allocate>(allocate),
+                      workspace,
+                      region);
+}
+/**
+ * @brief Maps (or reads) a png file, checks its signature and decodes it in the tensor provided by allocate
+ *
+ * @tparam Allocate see decode_png
+ * @param filepath
+ * @param options
+ * @param allocate
+ * @param workspace
+ * @param region see decode_png
+ * @return torch::Tensor
+ */
+template <typename Allocate>
+torch::Tensor decode_file(const fs::path&      filepath,
+                          const DecodeOptions& options,
+                          Allocate&&           allocate,
+                          Workspace&           workspace,
+                          const Region*        region = NULL) {
+    TORCH_PNG_STAGE_START(io_start);
+    const InputFile file(filepath);
+    TORCH_PNG_STAGE_END(IO, io_start, file.size());
+    check_signature(filepath, file);
+
+    return decode_bytes(
+        filepath.string(), file.data(), file.size(), options, std::forward<Allocate>(allocate), workspace, region);
+}
+/**
+ * @brief Decodes a png buffer in the tensor provided by allocate
+ *
+ * @tparam Allocate see decode_png
+ * @param data
+ * @param size
+ * @param options
+ * @param allocate
+ * @param workspace
+ * @return torch::Tensor
+ */
+template <typename Allocate>
+torch::Tensor decode_buffer(const std::uint8_t*  data,
+                            std::size_t          size,
+                            const DecodeOptions& options,
+                            Allocate&&           allocate,
+                            Workspace&           workspace) {
+    // test if png buffer
+    if (!data || size < 8 || png_sig_cmp((png_const_bytep)data, 0, 8))
+        throw DecodeError(memory_source, "Not a png buffer.");
+
+    return decode_bytes(memory_source, data, size, options, std::forward<Allocate>(allocate), workspace);
+}
+/**
+ * @brief Checks that out can be filled by decode_png: a 3D cpu tensor of an image dtype whose rows pixels
+ * are contiguous within each plane (CHW) or interleaved (HWC)
+ *
+ * @param out
+ * @param layout
+ */
+void check_output(const torch::Tensor& out, Layout layout) {
+    if (out.dim() != 3)
+        throw std::invalid_argument("Unexpected torch::Tensor dimensions.\nGot(" + std::to_string(out.dim()) +
+                                    "). Expects 3.");
+    check_dtype(out.scalar_type());
+    if (!out.device().is_cpu())
+        throw std::invalid_argument("Unexpected torch::Tensor device. Expects: torch::kCPU");
+    if (out.stride(2) != 1 || (layout == Layout::HWC && out.stride(1) != out.size(2)))
+        throw std::invalid_argument("Unexpected torch::Tensor strides. Expects contiguous rows.");
+}
+/**
+ * @brief Returns out if its dims match the decoded image, used as the allocate argument of decode_png
+ *
+ * @param out
+ * @param layout
+ * @return callable used as the allocate argument of decode_png
+ */
+auto reuse_output(const torch::Tensor& out, Layout layout) {
+    return [&out, layout](std::int64_t height, std::int64_t width, std::int64_t channels, torch::Dtype dtype) {
+        if (out.scalar_type() != dtype)
+            throw std::invalid_argument("Unexpected torch::Tensor type. Expects the type of DecodeOptions::dtype.");
+        const auto dims = image_dims(height, width, channels, layout);
+        if (out.sizes() != torch::IntArrayRef(dims))
+            throw std::invalid_argument("Unexpected torch::Tensor dims. Expects (" + std::to_string(dims[0]) + ", " +
+                                        std::to_string(dims[1]) + ", " + std::to_string(dims[2]) + ").");
+        return out;
+    };
+}
+/**
+ * @brief libpng write callback appending the encoded bytes to a std::vector<std::uint8_t>
+ *
+ * @param png_ptr png struct whose io_ptr is a std::vector<std::uint8_t>
+ * @param data bytes produced by libpng
+ * @param length number of bytes produced by libpng
+ */
+void write_to_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
+    auto* buffer = static_cast<std::vector<std::uint8_t>*>(png_get_io_ptr(png_ptr));
+    // exceptions can't cross the C frames of libpng: the error longjmps once the exception is destroyed
+    bool out_of_memory = false;
+    try {
+        buffer->insert(buffer->end(), data, data + length);
+    } catch (const std::bad_alloc&) {
+        out_of_memory = true;
+    }
+    if (out_of_memory)
+        png_error(png_ptr, "Out of memory");
+}
+/**
+ * @brief libpng flush callback, nothing to flush when writing to memory
+ */
+void flush_memory(png_structp) {}
+/**
+ * @brief libpng write callback, like the one of png_init_io but timed as I/O
+ *
+ * @param png_ptr png struct whose io_ptr is a FILE
+ * @param data
+ * @param length
+ */
+void write_to_file(png_structp png_ptr, png_bytep data, png_size_t length) {
+    TORCH_PNG_STAGE_START(write_start);
+    const auto written = fwrite(data, 1, length, static_cast<FILE*>(png_get_io_ptr(png_ptr)));
+    TORCH_PNG_STAGE_END(IO, write_start, written);
+
+    if (written != length)
+        png_error(png_ptr, "Write Error");
+}
+/**
+ * @brief libpng flush callback of write_to_file
+ */
+void flush_file(png_structp png_ptr) {
+    fflush(static_cast<FILE*>(png_get_io_ptr(png_ptr)));
+}
+/**
+ * @brief Number of rows of the bands deflated in parallel by encode_parallel, ~256KB of filtered rows
+ *
+ * @param rowbytes
+ * @return std::int64_t
+ */
+std::int64_t band_rows(std::int64_t rowbytes) {
+    return std::max<std::int64_t>(1, (std::int64_t(1) << 18) / (rowbytes + 1));
+}
+/**
+ * @brief Upper bound of the size of a png holding an image of height rows of rowbytes bytes.
+ * Accounts for the filter byte of each row, the deflate overhead (zlib bounds), the zlib header/checksum,
+ * the sync flushes of the parallel bands, the IDAT chunks headers and the signature, IHDR and IEND chunks.
+ * Reserving this much guarantees a single allocation when encoding to memory.
+ *
+ * @param height
+ * @param rowbytes
+ * @param options the zlib settings and the encoder (libpng or encode_parallel) change the bound
+ * @return std::size_t
+ */
+std::size_t encoded_size_bound(std::int64_t height, std::int64_t rowbytes, const EncodeOptions& options) {
+    // Adam7: the rows of the 7 passes (less than 2 * height + 7) have a filter byte each
+    const auto filter_bytes = options.interlace ? 2 * height + 7 : height;
+    const auto raw_bytes    = static_cast<uLong>(height * rowbytes + filter_bytes);
+    // compressBound holds for the default window and memory level of zlib (stored blocks of 16KB). The smaller
+    // memory levels cut the stored blocks shorter and libpng shrinks the window of the images under 16KB:
+    // deflateBound without a stream is the bound of any settings. Both include the zlib header and adler32
+    const bool default_zlib = (options.window_bits == -1 || options.window_bits == 15) &&
+                              (options.mem_level == -1 || options.mem_level == 8) && raw_bytes > 16384;
+    const auto deflate_bytes = default_zlib ? compressBound(raw_bytes) : deflateBound(Z_NULL, raw_bytes);
+    // the parallel bands are bounded one by one (7 bytes each) and end with a sync flush (5 bytes)
+    const auto bands =
+        options.threads != 1 && !options.interlace ? (height + band_rows(rowbytes) - 1) / band_rows(rowbytes) : 1;
+    const auto zlib_bytes = static_cast<std::size_t>(deflate_bytes) + static_cast<std::size_t>(bands) * 12;
+    // libpng splits the zlib stream in IDAT chunks of 8192 bytes, encode_parallel in one per band,
+    // 12 bytes of overhead each
+    const auto idat_bytes = zlib_bytes + 12 * (zlib_bytes / 8192 + 1 + static_cast<std::size_t>(bands));
+    // signature (8) + IHDR (25) + IEND (12)
+    return idat_bytes + 8 + 25 + 12;
+}
+/**
+ * @brief Encodes a cpu tensor with dims {channels, height, width} and any strides.
+ * Rows whose pixels are already interleaved in memory (e.g. a permuted contiguous HWC tensor)
+ * are handed to libpng as is, other rows are interleaved one at a time in a single row buffer.
+ * The output sink is provided by init_io so that files and memory buffers share
+ * the same header and row writing logic.
+ *
+ * Errors are thrown as EncodeError.
+ *
+ * @tparam InitIO callable with signature void(png_structp)
+ * @param source file path (or description of the buffer) reported in the errors
+ * @param tensor cpu tensor with dims {channels, height, width}, see InterleavedRows for the bit depth
+ * @param init_io sets the libpng output (png_init_io, png_set_write_fn, ...)
+ * @param options compression settings, see check_options
+ * @param workspace libpng allocator and row buffer
+ */
+template <typename InitIO>
+void encode_png(const std::string&   source,
+                const torch::Tensor& tensor,
+                InitIO&&             init_io,
+                const EncodeOptions& options,
+                Workspace&           workspace) {
+    WriteStructs png(source, workspace.pool);
+    const auto   png_ptr  = png.png_ptr;
+    const auto   info_ptr = png.info_ptr;
+    auto&        row      = workspace.row;
+
+    const auto channels = tensor.size(0);
+    const auto height   = tensor.size(1);
+    const auto width    = tensor.size(2);
+    // holds a torch::Tensor: constructed before the setjmp, libpng longjmps past the locals declared after it
+    const InterleavedRows rows(tensor);
+    // libpng errors longjmp here
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw EncodeError(source, png.error.message);
+
+    init_io(png_ptr);
 
     png_set_IHDR(png_ptr,
                  info_ptr,
                  width,
                  height,
-                 (CHAR_BIT * sizeof(std::uint8_t)),
+                 rows.bit_depth(),
                  channel_idx_to_color[channels - 1],
-                 PNG_INTERLACE_NONE,
+                 options.interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE,
                  PNG_FILTER_TYPE_BASE);
 
+    // compression and filtering must be set before the first row is written
+    if (options.compression_level != -1)
+        png_set_compression_level(png_ptr, options.compression_level);
+    if (options.strategy != -1)
+        png_set_compression_strategy(png_ptr, options.strategy);
+    if (options.window_bits != -1)
+        png_set_compression_window_bits(png_ptr, options.window_bits);
+    if (options.mem_level != -1)
+        png_set_compression_mem_level(png_ptr, options.mem_level);
+    if (options.filters != -1)
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, options.filters);
+
+    TORCH_PNG_STAGE_START(header_start);
     png_write_info(png_ptr, info_ptr);
+    TORCH_PNG_STAGE_END(Header, header_start, 0);
 
-    // write bytes
-    if (setjmp(png_jmpbuf(png_ptr)))
-        abort();
+    if (!rows.interleaved())
+        row.resize(rows.rowbytes());
+    // Adam7: the full rows are written once per pass, libpng extracts the pixels of the pass
+    const int passes = options.interlace ? png_set_interlace_handling(png_ptr) : 1;
+    // libpng filters and deflates the rows (and writes the compressed bytes) in png_write_row and png_write_end
+    for (int pass = 0; pass < passes; ++pass) {
+        for (std::int64_t y = 0; y < height; ++y) {
+            const auto* pixels = rows.row(y, row.data());
 
-    for (std::int64_t offset = 0; offset < height * width * channels; offset += width * channels)
-        png_write_row(png_ptr, (tensor_cpy.data_ptr<std::uint8_t>() + offset));
+            TORCH_PNG_STAGE_START(deflate_start);
+            png_write_row(png_ptr, pixels);
+            TORCH_PNG_STAGE_END(Deflate, deflate_start, rows.rowbytes());
+        }
+    }
+    TORCH_PNG_STAGE_START(end_start);
+    png_write_end(png_ptr, NULL);
+    TORCH_PNG_STAGE_END(Deflate, end_start, 0);
+}
+/**
+ * @brief Paeth predictor of the png specification
+ *
+ * @param a left byte
+ * @param b up byte
+ * @param c up left byte
+ * @return int the closest of a, b, c to a + b - c
+ */
+inline int paeth_predictor(int a, int b, int c) {
+    const int p  = a + b - c;
+    const int pa = std::abs(p - a);
+    const int pb = std::abs(p - b);
+    const int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+/**
+ * @brief Applies a png filter to a row
+ *
+ * @param filter_type PNG_FILTER_VALUE_NONE, _SUB, _UP, _AVG or _PAETH
+ * @param row raw row
+ * @param prev previous raw row (zeros for the first row of the image)
+ * @param rowbytes
+ * @param bpp bytes per pixel
+ * @param out filtered row (without the filter type byte)
+ */
+void filter_row(int filter_type,
+                const std::uint8_t* __restrict row,
+                const std::uint8_t* __restrict prev,
+                std::int64_t rowbytes,
+                std::int64_t bpp,
+                std::uint8_t* __restrict out) {
+    switch (filter_type) {
+        case PNG_FILTER_VALUE_NONE:
+            std::memcpy(out, row, rowbytes);
+            break;
+        case PNG_FILTER_VALUE_SUB:
+            for (std::int64_t i = 0; i < bpp; ++i)
+                out[i] = row[i];
+            for (std::int64_t i = bpp; i < rowbytes; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - row[i - bpp]);
+            break;
+        case PNG_FILTER_VALUE_UP:
+            for (std::int64_t i = 0; i < rowbytes; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - prev[i]);
+            break;
+        case PNG_FILTER_VALUE_AVG:
+            for (std::int64_t i = 0; i < bpp; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - (prev[i] >> 1));
+            for (std::int64_t i = bpp; i < rowbytes; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+            break;
+        case PNG_FILTER_VALUE_PAETH:
+            for (std::int64_t i = 0; i < bpp; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - prev[i]);
+            for (std::int64_t i = bpp; i < rowbytes; ++i)
+                out[i] = static_cast<std::uint8_t>(row[i] - paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]));
+            break;
+    }
+}
+/**
+ * @brief Filters a row with the filter of the mask that minimizes the sum of the absolute values
+ * of the filtered bytes (the heuristic used by libpng)
+ *
+ * @param filters mask of PNG_FILTER_* flags
+ * @param row raw row
+ * @param prev previous raw row (zeros for the first row of the image)
+ * @param rowbytes
+ * @param bpp bytes per pixel
+ * @param out filter type byte followed by the filtered row (rowbytes + 1 bytes)
+ * @param scratch rowbytes + 1 bytes
+ */
+void filter_row_adaptive(int                 filters,
+                         const std::uint8_t* row,
+                         const std::uint8_t* prev,
+                         std::int64_t        rowbytes,
+                         std::int64_t        bpp,
+                         std::uint8_t*       out,
+                         std::uint8_t*       scratch) {
+    std::uint8_t* best     = NULL;
+    std::uint64_t best_sum = 0;
 
-    // end write
-    if (setjmp(png_jmpbuf(png_ptr)))
-        abort();
+    for (int filter_type = PNG_FILTER_VALUE_NONE; filter_type < PNG_FILTER_VALUE_LAST; ++filter_type) {
+        if (!(filters & (PNG_FILTER_NONE << filter_type)))
+            continue;
+        // the candidate is written in the buffer that doesn't hold the best one so far
+        auto* candidate = best == out ? scratch : out;
+        candidate[0]    = static_cast<std::uint8_t>(filter_type);
+        filter_row(filter_type, row, prev, rowbytes, bpp, candidate + 1);
 
-    png_write_end(png_ptr, NULL);
+        std::uint64_t sum = 0;
+        for (std::int64_t i = 1; i <= rowbytes; ++i)
+            sum += std::abs(static_cast<std::int8_t>(candidate[i]));
+
+        if (!best || sum < best_sum) {
+            best     = candidate;
+            best_sum = sum;
+        }
+    }
+    if (best != out)
+        std::memcpy(out, best, rowbytes + 1);
+}
+/**
+ * @brief zlib settings of the encoders that drive zlib themselves, the EncodeOptions with the libpng defaults resolved
+ */
+struct DeflateSettings {
+    int level;
+    int strategy;
+    int filters;
+    int window_bits;
+    int mem_level;
+};
+/**
+ * @brief Owns a raw deflate stream
+ */
+struct DeflateStream {
+    DeflateStream(const std::string& source, const DeflateSettings& settings) {
+        // negative window bits: raw deflate, the zlib header and checksum are written by the encoders
+        if (deflateInit2(&stream, settings.level, Z_DEFLATED, -settings.window_bits, settings.mem_level,
+                         settings.strategy) != Z_OK)
+            throw EncodeError(source, "Cannot initialize the zlib deflate stream.");
+    }
+    ~DeflateStream() { deflateEnd(&stream); }
+
+    DeflateStream(const DeflateStream&) = delete;
+    DeflateStream& operator=(const DeflateStream&) = delete;
 
-    png_destroy_write_struct(&png_ptr, &info_ptr);
+    z_stream stream{};
+};
+/**
+ * @brief Resolves the -1 (libpng default) settings of the options for the encoders that drive zlib themselves
+ *
+ * @param options
+ * @return DeflateSettings
+ */
+DeflateSettings deflate_settings(const EncodeOptions& options) {
+    DeflateSettings settings;
+    settings.filters     = options.filters != -1 ? options.filters : PNG_ALL_FILTERS;
+    settings.level       = options.compression_level != -1 ? options.compression_level : Z_DEFAULT_COMPRESSION;
+    settings.strategy    = options.strategy != -1 ? options.strategy
+                           : settings.filters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY
+                                                                 : Z_FILTERED;
+    // zlib rejects a 256 bytes window for raw deflate streams, it uses 512 bytes for zlib streams of window bits 8
+    // (and libpng does the same), the zlib header then advertises the 512 bytes window
+    settings.window_bits = options.window_bits != -1 ? std::max(options.window_bits, 9) : 15;
+    settings.mem_level   = options.mem_level != -1 ? options.mem_level : 8;
+    return settings;
+}
+/**
+ * @brief Filters a row with the filter of settings.filters (the adaptive heuristic if it has several)
+ *
+ * @param settings
+ * @param row raw row
+ * @param prev previous raw row (zeros for the first row of the image)
+ * @param rowbytes
+ * @param bpp bytes per pixel
+ * @param out filter type byte followed by the filtered row (rowbytes + 1 bytes)
+ * @param scratch rowbytes + 1 bytes, unused with a single filter
+ */
+void filter_row(const DeflateSettings& settings,
+                const std::uint8_t*    row,
+                const std::uint8_t*    prev,
+                std::int64_t           rowbytes,
+                std::int64_t           bpp,
+                std::uint8_t*          out,
+                std::uint8_t*          scratch) {
+    if (settings.filters & (settings.filters - 1)) {
+        filter_row_adaptive(settings.filters, row, prev, rowbytes, bpp, out, scratch);
+        return;
+    }
+    int filter_type = PNG_FILTER_VALUE_NONE;
+    while (!(settings.filters & (PNG_FILTER_NONE << filter_type)))
+        ++filter_type;
+    out[0] = static_cast<std::uint8_t>(filter_type);
+    filter_row(filter_type, row, prev, rowbytes, bpp, out + 1);
 }
+/**
+ * @brief Band of rows filtered and deflated independently by encode_parallel
+ */
+struct DeflatedBand {
+    std::vector<std::uint8_t> bytes;     // raw deflate data, byte aligned (sync flushed) unless last
+    uLong                     adler;     // adler32 of the filtered rows
+    std::size_t               raw_size;  // number of filtered bytes (filter type bytes included)
+};
+/**
+ * @brief Filters and deflates the rows [y0, y1) in their own raw deflate stream (pigz style).
+ * The window is primed with the filtered rows preceding y0 so that the compression ratio
+ * is close to the one of a single stream.
+ *
+ * @param source reported in the errors
+ * @param rows
+ * @param y0
+ * @param y1
+ * @param bpp bytes per pixel
+ * @param settings
+ * @param last the last band finishes the deflate stream, the others are sync flushed
+ * @param band
+ */
+void deflate_band(const std::string&     source,
+                  const InterleavedRows& rows,
+                  std::int64_t           y0,
+                  std::int64_t           y1,
+                  std::int64_t           bpp,
+                  const DeflateSettings& settings,
+                  bool                   last,
+                  DeflatedBand&          band) {
+    const auto rowbytes      = rows.rowbytes();
+    const auto window_size   = std::int64_t(1) << settings.window_bits;
+    const auto dict_rows     = std::min(y0, (window_size + rowbytes) / (rowbytes + 1));
+    const auto dict_bytes    = dict_rows * (rowbytes + 1);
+    const auto y_first       = y0 - dict_rows;
+    const bool single_filter = (settings.filters & (settings.filters - 1)) == 0;
+
+    std::vector<std::uint8_t> filtered((y1 - y_first) * (rowbytes + 1));
+    std::vector<std::uint8_t> cur_buffer(rows.interleaved() ? 0 : rowbytes);
+    std::vector<std::uint8_t> prev_buffer(rows.interleaved() ? 0 : rowbytes);
+    std::vector<std::uint8_t> zeros(y_first ? 0 : rowbytes);
+    std::vector<std::uint8_t> scratch(single_filter ? 0 : rowbytes + 1);
+
+    const std::uint8_t* prev = y_first ? rows.row(y_first - 1, prev_buffer.data()) : zeros.data();
+
+    for (std::int64_t y = y_first; y < y1; ++y) {
+        // the conversion of the row (InterleavedRows::row) is recorded on its own
+        TORCH_PNG_STAGE_SCOPE(filter_scope, Filter, rowbytes);
+        const auto* row = rows.row(y, cur_buffer.data());
+        auto*       out = filtered.data() + (y - y_first) * (rowbytes + 1);
+
+        filter_row(settings, row, prev, rowbytes, bpp, out, scratch.data());
+        // the row becomes the previous one, its buffer (if any) must not be overwritten
+        prev = row;
+        std::swap(cur_buffer, prev_buffer);
+    }
+    const auto* input      = filtered.data() + dict_bytes;
+    const auto  input_size = filtered.size() - dict_bytes;
+
+    TORCH_PNG_STAGE_SCOPE(deflate_scope, Deflate, input_size);
+
+    band.raw_size = input_size;
+    band.adler    = adler32(adler32(0L, Z_NULL, 0), input, static_cast<uInt>(input_size));
+
+    DeflateStream deflater(source, settings);
+    auto&         stream = deflater.stream;
+
+    if (dict_bytes) {
+        const auto dict_size = std::min<std::int64_t>(dict_bytes, window_size);
+        if (deflateSetDictionary(&stream, input - dict_size, static_cast<uInt>(dict_size)) != Z_OK)
+            throw EncodeError(source, "Cannot set the zlib deflate dictionary.");
+    }
+    stream.next_in  = const_cast<Bytef*>(input);
+    stream.avail_in = static_cast<uInt>(input_size);
+
+    const int flush    = last ? Z_FINISH : Z_SYNC_FLUSH;
+    auto&     bytes    = band.bytes;
+    std::size_t produced = 0;
+    int         ret      = Z_OK;
+    bytes.resize(deflateBound(&stream, input_size) + 16);
+
+    do {
+        if (produced == bytes.size())
+            bytes.resize(2 * bytes.size());
+
+        stream.next_out  = bytes.data() + produced;
+        stream.avail_out = static_cast<uInt>(bytes.size() - produced);
+
+        ret = deflate(&stream, flush);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            throw EncodeError(source, "zlib deflate error (" + std::to_string(ret) + ").");
+
+        produced = bytes.size() - stream.avail_out;
+    } while (stream.avail_out == 0 || (last && ret != Z_STREAM_END));
+
+    bytes.resize(produced);
+}
+/**
+ * @brief Writes a 32 bits unsigned integer in network byte order
+ */
+inline void put_uint32(std::uint8_t* out, std::uint32_t value) {
+    out[0] = static_cast<std::uint8_t>(value >> 24);
+    out[1] = static_cast<std::uint8_t>(value >> 16);
+    out[2] = static_cast<std::uint8_t>(value >> 8);
+    out[3] = static_cast<std::uint8_t>(value);
+}
+/**
+ * @brief Writes a png chunk whose data is the concatenation of pieces
+ *
+ * @tparam Write callable with signature void(const std::uint8_t* data, std::size_t size)
+ * @param write
+ * @param type chunk type, e.g. "IDAT"
+ * @param pieces {data, size} pairs
+ */
+template <typename Write>
+void write_chunk(Write&&                                                               write,
+                 const char*                                                           type,
+                 std::initializer_list<std::pair<const std::uint8_t*, std::size_t>> pieces) {
+    std::size_t length = 0;
+    for (const auto& piece : pieces)
+        length += piece.second;
+
+    std::uint8_t header[8];
+    put_uint32(header, static_cast<std::uint32_t>(length));
+    std::memcpy(header + 4, type, 4);
+    write(header, 8);
+
+    auto crc = crc32(crc32(0L, Z_NULL, 0), header + 4, 4);
+    for (const auto& piece : pieces) {
+        if (!piece.second)
+            continue;
+        write(piece.first, piece.second);
+        crc = crc32(crc, piece.first, static_cast<uInt>(piece.second));
+    }
+    std::uint8_t footer[4];
+    put_uint32(footer, static_cast<std::uint32_t>(crc));
+    write(footer, 4);
+}
+/**
+ * @brief Writes the png signature and the IHDR chunk of a non interlaced image
+ *
+ * @tparam Write callable with signature void(const std::uint8_t* data, std::size_t size)
+ * @param write
+ * @param height
+ * @param width
+ * @param bit_depth 8 or 16
+ * @param channels 1 to 4
+ */
+template <typename Write>
+void write_header(Write&& write, std::int64_t height, std::int64_t width, int bit_depth, std::int64_t channels) {
+    static constexpr std::uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    write(signature, 8);
+
+    std::uint8_t ihdr[13];
+    put_uint32(ihdr, static_cast<std::uint32_t>(width));
+    put_uint32(ihdr + 4, static_cast<std::uint32_t>(height));
+    ihdr[8]  = static_cast<std::uint8_t>(bit_depth);
+    ihdr[9]  = channel_idx_to_color[channels - 1];
+    ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+    ihdr[11] = PNG_FILTER_TYPE_BASE;
+    ihdr[12] = PNG_INTERLACE_NONE;
+    write_chunk(write, "IHDR", {{ihdr, 13}});
+}
+/**
+ * @brief zlib header of a raw deflate stream: deflate method, window size and compression level hint
+ *
+ * @param settings
+ * @param header 2 bytes
+ */
+void zlib_header(const DeflateSettings& settings, std::uint8_t* header) {
+    const int flevel = settings.level == Z_DEFAULT_COMPRESSION ? 2
+                       : settings.level < 2                   ? 0
+                       : settings.level < 6                   ? 1
+                       : settings.level == 6                  ? 2
+                                                              : 3;
+    header[0] = static_cast<std::uint8_t>(((settings.window_bits - 8) << 4) | Z_DEFLATED);
+    header[1] = static_cast<std::uint8_t>(flevel << 6);
+    header[1] += 31 - (header[0] * 256 + header[1]) % 31;
+}
+/**
+ * @brief Encodes a cpu tensor with dims {channels, height, width} by filtering and deflating bands of rows
+ * on options.threads threads. The bands are stitched in a single zlib stream (sync flushed raw deflate
+ * blocks, combined adler32) split in one IDAT chunk per band, which is a standard png.
+ *
+ * @tparam Write callable with signature void(const std::uint8_t* data, std::size_t size)
+ * @param source reported in the errors
+ * @param tensor cpu tensor with dims {channels, height, width}, see InterleavedRows for the bit depth
+ * @param options
+ * @param write receives the png bytes in order
+ */
+template <typename Write>
+void encode_parallel(const std::string&   source,
+                     const torch::Tensor& tensor,
+                     const EncodeOptions& options,
+                     Write&&              write) {
+    const auto channels = tensor.size(0);
+    const auto height   = tensor.size(1);
+    const auto width    = tensor.size(2);
+
+    if (!height || !width)
+        throw EncodeError(source, "Invalid image dims. Expects a non empty image.");
+
+    const InterleavedRows rows(tensor);
+    const auto            settings = deflate_settings(options);
+    const auto rows_per_band = band_rows(rows.rowbytes());
+    const auto bands         = (height + rows_per_band - 1) / rows_per_band;
 
-void encode_batch(fs::path filepath, const torch::Tensor& tensor, const std::string& delimiter) {
+    std::vector<DeflatedBand> deflated(bands);
+
+    parallel_for(
+        bands,
+        [&](std::int64_t b) {
+            const auto y0 = b * rows_per_band;
+            const auto y1 = std::min(height, y0 + rows_per_band);
+            deflate_band(source, rows, y0, y1, rows.pixelbytes(), settings, b == bands - 1, deflated[b]);
+        },
+        options.threads);
+
+    write_header(write, height, width, rows.bit_depth(), channels);
+
+    std::uint8_t header[2];
+    zlib_header(settings, header);
+
+    auto adler = adler32(0L, Z_NULL, 0);
+    for (const auto& band : deflated)
+        adler = adler32_combine(adler, band.adler, static_cast<z_off_t>(band.raw_size));
+
+    std::uint8_t zlib_footer[4];
+    put_uint32(zlib_footer, static_cast<std::uint32_t>(adler));
+
+    for (std::int64_t b = 0; b < bands; ++b)
+        write_chunk(write,
+                    "IDAT",
+                    {{header, b == 0 ? 2 : 0},
+                     {deflated[b].bytes.data(), deflated[b].bytes.size()},
+                     {zlib_footer, b == bands - 1 ? 4 : 0}});
+
+    write_chunk(write, "IEND", {});
+}
+/**
+ * @brief Encodes a checked cpu tensor to a file, with libpng or encode_parallel w.r.t. options.threads
+ *
+ * @param filepath
+ * @param tensor cpu image tensor with dims {channels, height, width}
+ * @param options
+ * @param workspace
+ * @return std::size_t number of bytes written
+ */
+std::size_t encode_file(const fs::path&      filepath,
+                        const torch::Tensor& tensor,
+                        const EncodeOptions& options,
+                        Workspace&           workspace) {
+    TORCH_PNG_STAGE_START(open_start);
+    auto fp = make_unique_fp(filepath.c_str(), "wb");
+    TORCH_PNG_STAGE_END(IO, open_start, 0);
+    if (!fp.get())
+        throw EncodeError(filepath.string(), std::string("Cannot open file. ") + std::strerror(errno));
+
+    // the parallel encoder writes non interlaced pngs
+    if (options.threads != 1 && !options.interlace) {
+        encode_parallel(filepath.string(), tensor, options, [&](const std::uint8_t* data, std::size_t size) {
+            TORCH_PNG_STAGE_SCOPE(write_scope, IO, size);
+            if (fwrite(data, 1, size, fp.get()) != size)
+                throw EncodeError(filepath.string(), std::string("Cannot write file. ") + std::strerror(errno));
+        });
+    } else {
+        encode_png(
+            filepath.string(),
+            tensor,
+            [&fp](png_structp png_ptr) { png_set_write_fn(png_ptr, fp.get(), write_to_file, flush_file); },
+            options,
+            workspace);
+    }
+    // write errors of the buffered bytes are reported here rather than lost when the file is closed
+    TORCH_PNG_STAGE_START(flush_start);
+    const int flushed = fflush(fp.get());
+    TORCH_PNG_STAGE_END(IO, flush_start, 0);
+    if (flushed)
+        throw EncodeError(filepath.string(), std::string("Cannot write file. ") + std::strerror(errno));
+
+    return static_cast<std::size_t>(ftell(fp.get()));
+}
+/**
+ * @brief Encodes a checked cpu tensor at the end of buffer, with libpng or encode_parallel w.r.t. options.threads
+ *
+ * @param buffer
+ * @param tensor cpu image tensor with dims {channels, height, width}
+ * @param options
+ * @param workspace
+ */
+void encode_buffer(std::vector<std::uint8_t>& buffer,
+                   const torch::Tensor&       tensor,
+                   const EncodeOptions&       options,
+                   Workspace&                 workspace) {
+    buffer.reserve(buffer.size() + encoded_size_bound(tensor.size(1), InterleavedRows(tensor).rowbytes(), options));
+    // the parallel encoder writes non interlaced pngs
+    if (options.threads != 1 && !options.interlace) {
+        encode_parallel(memory_source, tensor, options, [&buffer](const std::uint8_t* data, std::size_t size) {
+            buffer.insert(buffer.end(), data, data + size);
+        });
+    } else {
+        encode_png(
+            memory_source,
+            tensor,
+            [&buffer](png_structp png_ptr) { png_set_write_fn(png_ptr, &buffer, write_to_memory, flush_memory); },
+            options,
+            workspace);
+    }
+}
+
+/**
+ * @brief Decodes a batch of pngs in parallel into a single batched tensor, see decode_batch.
+ * The headers are read first so that the output is allocated once and each image is decoded straight into its slice.
+ *
+ * @tparam Source callable with signature std::string(std::int64_t b), reported in the errors of the image b
+ * @tparam ReadHeader callable with signature PngHeader(std::int64_t b)
+ * @tparam Decode callable with signature void(std::int64_t b, Allocate allocate, Workspace& workspace)
+ * decoding the image b in the tensor provided by allocate (see decode_png)
+ * @param batch number of images
+ * @param source
+ * @param header
+ * @param decode
+ * @param policy
+ * @param options
+ * @return torch::Tensor
+ */
+template <typename Source, typename ReadHeader, typename Decode>
+torch::Tensor decode_batch_of(std::int64_t         batch,
+                              Source&&             source,
+                              ReadHeader&&         header,
+                              Decode&&             decode,
+                              BatchPolicy          policy,
+                              const DecodeOptions& options) {
+    if (!batch)
+        throw std::invalid_argument("Unexpected number of images. Expects at least 1.");
+    check_options(options);
+    // read the headers first to allocate a single output for the whole batch
+    std::vector<PngHeader> headers(batch);
+
+    parallel_for(batch, [&](std::int64_t b) { headers[b] = header(b); });
+
+    const auto image_channels = [&options](const PngHeader& header) {
+        return decoded_channels(header.color_type, header.channels, header.has_trns, options);
+    };
+    std::int64_t height = 0, width = 0;
+    bool         same_dims = true;
+    const auto   channels  = image_channels(headers[0]);
+    const auto   dtype     = output_dtype(options, headers[0].bit_depth);
+
+    for (std::int64_t b = 0; b < batch; ++b) {
+        // dims of the decoded (possibly downscaled) image
+        const auto         h         = scaled_size(headers[b].height, options.scale_factor);
+        const auto         w         = scaled_size(headers[b].width, options.scale_factor);
+        const auto         c         = image_channels(headers[b]);
+        const auto         bit_depth = headers[b].bit_depth;
+
+        if (c != channels)
+            throw std::invalid_argument("Unexpected png channels in " + source(b) + ".\nGot(" +
+                                        std::to_string(c) + "). Expects " + std::to_string(channels) + ".");
+        if (output_dtype(options, bit_depth) != dtype)
+            throw std::invalid_argument("Unexpected png bit depth in " + source(b) + ".\nGot(" +
+                                        std::to_string(bit_depth) + "). Set DecodeOptions::dtype to mix bit depths.");
+        if (b && (h != height || w != width)) {
+            if (policy == BatchPolicy::Error)
+                throw std::invalid_argument("Unexpected png dims in " + source(b) + ".\nGot(" +
+                                            std::to_string(h) + ", " + std::to_string(w) + "). Expects (" +
+                                            std::to_string(height) + ", " + std::to_string(width) + ").");
+            same_dims = false;
+        }
+        height = std::max<std::int64_t>(height, h);
+        width  = std::max<std::int64_t>(width, w);
+    }
+    auto batch_dims = image_dims(height, width, channels, options.layout);
+    batch_dims.insert(batch_dims.begin(), batch);
+
+    auto tensor_options = torch::TensorOptions().dtype(dtype).device(torch::kCPU);
+    // padding must be zeroed when images are smaller than the batch
+    auto torch_tensor = same_dims ? torch::empty(batch_dims, tensor_options) : torch::zeros(batch_dims, tensor_options);
+
+    const std::int64_t h_dim = options.layout == Layout::HWC ? 0 : 1;
+
+    parallel_for(batch, [&](std::int64_t b) {
+        // each image is decoded straight into its (top left corner) slice of the batch
+        const auto slice = torch_tensor.select(0, b)
+                               .narrow(h_dim, 0, scaled_size(headers[b].height, options.scale_factor))
+                               .narrow(h_dim + 1, 0, scaled_size(headers[b].width, options.scale_factor));
+
+        Workspace workspace;
+        decode(
+            b,
+            [&](std::int64_t h, std::int64_t w, std::int64_t c, torch::Dtype) {
+                if (slice.numel() != h * w * c)
+                    throw DecodeError(source(b), "Unexpected png dims. The file changed after its header was read.");
+                return slice;
+            },
+            workspace);
+    });
+    return torch_tensor;
+}
+
+/**
+ * @brief Hands a buffer over to a 1D torch::kUInt8 tensor, it will be freed along with the tensor storage
+ *
+ * @param buffer
+ * @return torch::Tensor
+ */
+torch::Tensor bytes_tensor(std::unique_ptr<std::vector<std::uint8_t>> buffer) {
+    auto* bytes        = buffer.get();
+    auto  torch_tensor = torch::from_blob(
+        bytes->data(),
+        {static_cast<std::int64_t>(bytes->size())},
+        [bytes](void*) { delete bytes; },
+        torch::TensorOptions().dtype(torch::kUInt8).device(torch::kCPU));
+    buffer.release();
+
+    return torch_tensor;
+}
+
+}  // namespace
+
+std::string backend() {
+    std::string libraries;
+#ifdef TORCH_PNG_SPNG
+    libraries += std::string("libspng ") + spng_version_string() + " (decode), ";
+#endif
+    libraries += std::string("libpng ") + png_get_libpng_ver(NULL);
+    // version of the zlib loaded at runtime, zlib-ng in compatible mode reports e.g. "1.3.1.zlib-ng"
+    libraries += std::string(", zlib ") + zlibVersion();
+    return libraries;
+}
+
+std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t> getDims(const fs::path& filepath,
+                                                                                          bool            validate) {
+    const auto header = validate ? read_header(filepath) : probe_header(filepath);
+
+    return {header.height, header.width, header.channels, header.bit_depth, header.color_type};
+}
+
+std::tuple<std::int32_t, std::int32_t, std::uint8_t, std::uint8_t, std::uint8_t>
+getDims_from_memory(const std::uint8_t* data, std::size_t size, bool validate) {
+    // the signature is checked before libpng reads the chunks
+    auto header = probe_header(memory_source, data, size);
+    if (validate)
+        header = read_header(memory_source, data, size);
+
+    return {header.height, header.width, header.channels, header.bit_depth, header.color_type};
+}
+
+ProbeResults probe_many(const std::vector<fs::path>& filepaths, bool validate, int threads) {
+    if (threads < 0)
+        throw std::invalid_argument("Unexpected number of threads.\nGot(" + std::to_string(threads) +
+                                    "). Expects 0 or more.");
+    const auto size = filepaths.size();
+
+    ProbeResults results;
+    results.height.assign(size, 0);
+    results.width.assign(size, 0);
+    results.channels.assign(size, 0);
+    results.bit_depth.assign(size, 0);
+    results.color_type.assign(size, 0);
+    results.errors.assign(size, nullptr);
+
+    parallel_for(
+        static_cast<std::int64_t>(size),
+        [&](std::int64_t i) {
+            // errors are reported per file, the other files are still probed
+            try {
+                const auto header = validate ? read_header(filepaths[i]) : probe_header(filepaths[i]);
+
+                results.height[i]     = header.height;
+                results.width[i]      = header.width;
+                results.channels[i]   = header.channels;
+                results.bit_depth[i]  = header.bit_depth;
+                results.color_type[i] = header.color_type;
+            } catch (...) {
+                results.errors[i] = std::current_exception();
+            }
+        },
+        threads);
+
+    return results;
+}
+
+torch::Tensor decode(const fs::path& filepath, const DecodeOptions& options) {
+    Workspace workspace;
+    return decode_file(filepath, options, allocate_image(options.layout), workspace);
+}
+
+torch::Tensor decode_roi(const fs::path&      filepath,
+                         std::int64_t         y0,
+                         std::int64_t         x0,
+                         std::int64_t         height,
+                         std::int64_t         width,
+                         const DecodeOptions& options) {
+    if (y0 < 0 || x0 < 0 || height <= 0 || width <= 0)
+        throw std::invalid_argument("Unexpected region (" + std::to_string(y0) + ", " + std::to_string(x0) + ", " +
+                                    std::to_string(height) + ", " + std::to_string(width) +
+                                    "). Expects a non negative origin and a non empty size.");
+    const Region region{y0, x0, height, width};
+
+    Workspace workspace;
+    return decode_file(filepath, options, allocate_image(options.layout), workspace, &region);
+}
+
+torch::Tensor decode_from_memory(const std::uint8_t* data, std::size_t size, const DecodeOptions& options) {
+    Workspace workspace;
+    return decode_buffer(data, size, options, allocate_image(options.layout), workspace);
+}
+
+torch::Tensor decode_from_memory(const torch::Tensor& bytes, const DecodeOptions& options) {
+    if (bytes.dtype() != torch::kUInt8)
+        throw std::invalid_argument("Unexpected torch::Tensor type. Expects: torch::kUInt8");
+    if (!bytes.device().is_cpu())
+        throw std::invalid_argument("Unexpected torch::Tensor device. Expects: torch::kCPU");
+    if (!bytes.is_contiguous())
+        throw std::invalid_argument("Unexpected torch::Tensor layout. Expects a contiguous buffer");
+
+    return decode_from_memory(bytes.data_ptr<std::uint8_t>(), static_cast<std::size_t>(bytes.numel()), options);
+}
+
+torch::Tensor decode_batch(const std::vector<fs::path>& filepaths, BatchPolicy policy, const DecodeOptions& options) {
+    return decode_batch_of(
+        static_cast<std::int64_t>(filepaths.size()),
+        [&filepaths](std::int64_t b) { return filepaths[b].string(); },
+        [&filepaths](std::int64_t b) { return read_header(filepaths[b]); },
+        [&filepaths, &options](std::int64_t b, auto&& allocate, Workspace& workspace) {
+            decode_file(filepaths[b], options, allocate, workspace);
+        },
+        policy,
+        options);
+}
+
+torch::Tensor decode_batch_from_memory(const std::vector<PngBuffer>& buffers,
+                                       BatchPolicy                   policy,
+                                       const DecodeOptions&          options) {
+    const auto source = [&buffers](std::int64_t b) {
+        return buffers[b].source.empty() ? memory_source : buffers[b].source;
+    };
+    return decode_batch_of(
+        static_cast<std::int64_t>(buffers.size()),
+        source,
+        [&](std::int64_t b) {
+            const auto& buffer = buffers[b];
+            if (!buffer.data || buffer.size < 8 || png_sig_cmp((png_const_bytep)buffer.data, 0, 8))
+                throw DecodeError(source(b), "Not a png buffer.");
+            return read_header(source(b), buffer.data, buffer.size);
+        },
+        [&](std::int64_t b, auto&& allocate, Workspace& workspace) {
+            decode_bytes(source(b), buffers[b].data, buffers[b].size, options, allocate, workspace);
+        },
+        policy,
+        options);
+}
+
+EncodeOptions EncodeOptions::fast() {
+    EncodeOptions options;
+    options.compression_level = 1;
+    options.strategy          = Z_RLE;
+    options.filters           = PNG_FILTER_SUB;
+    return options;
+}
+
+EncodeOptions EncodeOptions::best() {
+    EncodeOptions options;
+    options.compression_level = Z_BEST_COMPRESSION;
+    options.filters           = PNG_ALL_FILTERS;
+    return options;
+}
+
+void encode(const fs::path& filepath, const torch::Tensor& tensor, const EncodeOptions& options) {
+    const auto tensor_cpu = check_to_cpu(tensor);
+    check_options(options);
+
+    Workspace workspace;
+    encode_file(filepath, tensor_cpu, options, workspace);
+}
+
+torch::Tensor encode_to_memory(const torch::Tensor& tensor, const EncodeOptions& options) {
+    const auto tensor_cpu = check_to_cpu(tensor);
+    check_options(options);
+
+    auto buffer = std::make_unique<std::vector<std::uint8_t>>();
+
+    Workspace workspace;
+    encode_buffer(*buffer, tensor_cpu, options, workspace);
+    return bytes_tensor(std::move(buffer));
+}
+
+std::vector<torch::Tensor> encode_batch_to_memory(const torch::Tensor& tensor,
+                                                  const EncodeOptions& options,
+                                                  int                  threads) {
+    if (tensor.dim() != 4)
+        throw std::invalid_argument("Unexpected torch::Tensor dim.\nGot(" + std::to_string(tensor.dim()) +
+                                    "). Expects 4.");
+    if (threads < 0)
+        throw std::invalid_argument("Unexpected number of threads.\nGot(" + std::to_string(threads) +
+                                    "). Expects 0 or more.");
+    check_options(options);
+    // a single copy of the whole batch when it lives on another device, the items are strided views of it
+    const auto tensor_cpu = tensor.detach().to(torch::kCPU);
+    const auto batch      = tensor_cpu.size(0);
+
+    std::vector<std::unique_ptr<PooledWorkspace>> workspaces(thread_count(threads));
+    for (auto& workspace : workspaces)
+        workspace = std::make_unique<PooledWorkspace>();
+
+    std::vector<torch::Tensor> results(batch);
+    parallel_for(
+        batch,
+        [&](std::int64_t b) {
+            const auto image  = check_to_cpu(tensor_cpu.select(0, b));
+            auto       buffer = std::make_unique<std::vector<std::uint8_t>>();
+            encode_buffer(*buffer, image, options, workspaces[thread_index()]->workspace);
+            results[b] = bytes_tensor(std::move(buffer));
+        },
+        threads);
+
+    return results;
+}
+
+std::vector<EncodeResult> encode_batch(fs::path             filepath,
+                                       const torch::Tensor& tensor,
+                                       const std::string&   delimiter,
+                                       const EncodeOptions& options,
+                                       int                  threads) {
     if (tensor.dim() != 4)
         throw std::invalid_argument("Unexpected torch::Tensor dim.\nGot(" + std::to_string(tensor.dim()) +
                                     "). Expects 4.");
-    const auto batch = tensor.size(0);
+    if (threads < 0)
+        throw std::invalid_argument("Unexpected number of threads.\nGot(" + std::to_string(threads) +
+                                    "). Expects 0 or more.");
+    check_options(options);
+    // a single copy of the whole batch when it lives on another device, the items are strided views of it
+    const auto tensor_cpu = tensor.detach().to(torch::kCPU);
+    const auto batch      = tensor_cpu.size(0);
     // save a copy of extension (may be empty string "")
     const auto ext = filepath.extension();
     // save a copy of (f)ile(p)ath without extension and remove extension from filepath
     const auto fp_no_ext = filepath.replace_extension("");
-#ifdef _OPENMP
-#pragma omp parallel for firstprivate(filepath)
-#endif
+
+    std::vector<EncodeResult> results(batch);
     for (std::int64_t b = 0; b < batch; ++b) {
-        // append index
-        filepath += fs::path(delimiter + std::to_string(b));
-        // and extension
-        filepath += ext;
-        // encode a single image at a time
-        encode(filepath, tensor.index({b, idx::Ellipsis}));
-        // reset path to raw path name without extension
-        filepath = fp_no_ext;
+        // append index and extension to the raw path name
+        results[b].filepath = fp_no_ext;
+        results[b].filepath += fs::path(delimiter + std::to_string(b));
+        results[b].filepath += ext;
+    }
+    // one workspace per thread, its libpng allocations and row buffers are reused across the items
+    std::vector<std::unique_ptr<PooledWorkspace>> workspaces(thread_count(threads));
+    for (auto& workspace : workspaces)
+        workspace = std::make_unique<PooledWorkspace>();
+
+    parallel_for(
+        batch,
+        [&](std::int64_t b) {
+            // errors are reported per item, the other items are still encoded
+            try {
+                const auto image  = check_to_cpu(tensor_cpu.select(0, b));
+                auto&      result = results[b];
+                result.bytes = encode_file(result.filepath, image, options, workspaces[thread_index()]->workspace);
+            } catch (...) {
+                results[b].error = std::current_exception();
+            }
+        },
+        threads);
+
+    return results;
+}
+
+bool EncodeResult::ok() const noexcept {
+    return !error;
+}
+
+struct Decoder::Impl {
+    MemoryPool pool;
+    Workspace  workspace{&pool};
+};
+
+Decoder::Decoder(const DecodeOptions& options) : options_{options}, impl_{std::make_unique<Impl>()} {
+    check_options(options_);
+}
+
+Decoder::~Decoder() = default;
+
+Decoder::Decoder(Decoder&&) noexcept = default;
+
+Decoder& Decoder::operator=(Decoder&&) noexcept = default;
+
+torch::Tensor Decoder::decode(const fs::path& filepath) {
+    return decode_file(filepath, options_, allocate_image(options_.layout), impl_->workspace);
+}
+
+torch::Tensor Decoder::decode(const std::uint8_t* data, std::size_t size) {
+    return decode_buffer(data, size, options_, allocate_image(options_.layout), impl_->workspace);
+}
+
+void Decoder::decode_into(const fs::path& filepath, const torch::Tensor& out) {
+    check_output(out, options_.layout);
+    decode_file(filepath, options_, reuse_output(out, options_.layout), impl_->workspace);
+}
+
+void Decoder::decode_into(const std::uint8_t* data, std::size_t size, const torch::Tensor& out) {
+    check_output(out, options_.layout);
+    decode_buffer(data, size, options_, reuse_output(out, options_.layout), impl_->workspace);
+}
+
+struct Encoder::Impl {
+    MemoryPool                pool;
+    Workspace                 workspace{&pool};
+    std::vector<std::uint8_t> buffer;
+};
+
+Encoder::Encoder(const EncodeOptions& options) : options_{options}, impl_{std::make_unique<Impl>()} {
+    check_options(options_);
+}
+
+Encoder::~Encoder() = default;
+
+Encoder::Encoder(Encoder&&) noexcept = default;
+
+Encoder& Encoder::operator=(Encoder&&) noexcept = default;
+
+void Encoder::encode(const fs::path& filepath, const torch::Tensor& tensor) {
+    const auto tensor_cpu = check_to_cpu(tensor);
+
+    encode_file(filepath, tensor_cpu, options_, impl_->workspace);
+}
+
+const std::vector<std::uint8_t>& Encoder::encode_to_buffer(const torch::Tensor& tensor) {
+    const auto tensor_cpu = check_to_cpu(tensor);
+    // keeps the capacity of the previous calls
+    impl_->buffer.clear();
+    encode_buffer(impl_->buffer, tensor_cpu, options_, impl_->workspace);
+
+    return impl_->buffer;
+}
+
+struct StreamEncoder::Impl {
+    Impl(std::string          source,
+         Sink                 sink,
+         std::int64_t         height,
+         std::int64_t         width,
+         std::int64_t         channels,
+         const EncodeOptions& options)
+      : source{std::move(source)}, sink{std::move(sink)}, height{height}, width{width}, channels{channels} {
+        check_options(options);
+
+        if (height <= 0 || width <= 0 || height > PNG_UINT_31_MAX || width > PNG_UINT_31_MAX)
+            throw std::invalid_argument("Unexpected image dims (" + std::to_string(height) + ", " +
+                                        std::to_string(width) + "). Expects [1, 2^31 - 1].");
+        if (!is_valid_channels(channels))
+            throw std::invalid_argument("Unexpected torch::Tensor channels.\nGot(" + std::to_string(channels) +
+                                        "). Expects 1, 2, 3, 4.");
+        // the passes of an interlaced png need the whole image
+        if (options.interlace)
+            throw std::invalid_argument("Unexpected EncodeOptions::interlace.\nGot(true). Expects false, "
+                                        "StreamEncoder writes non interlaced pngs.");
+        settings = deflate_settings(options);
+    }
+    /**
+     * @brief Opens the png file, the encoder writes to it
+     */
+    Impl(const fs::path&      filepath,
+         std::int64_t         height,
+         std::int64_t         width,
+         std::int64_t         channels,
+         const EncodeOptions& options)
+      : Impl(filepath.string(), Sink(), height, width, channels, options) {
+        TORCH_PNG_STAGE_START(open_start);
+        file = make_unique_fp(filepath.c_str(), "wb");
+        TORCH_PNG_STAGE_END(IO, open_start, 0);
+        if (!file)
+            throw EncodeError(source, std::string("Cannot open file. ") + std::strerror(errno));
+
+        this->filepath = filepath;
+        sink           = [fp = file.get(), source = source](const std::uint8_t* data, std::size_t size) {
+            TORCH_PNG_STAGE_SCOPE(write_scope, IO, size);
+            if (fwrite(data, 1, size, fp) != size)
+                throw EncodeError(source, std::string("Cannot write file. ") + std::strerror(errno));
+        };
+    }
+    // an unfinished file is removed
+    ~Impl() {
+        if (closed || filepath.empty())
+            return;
+        file.reset();
+        std::error_code error;
+        fs::remove(filepath, error);
     }
+    /**
+     * @brief Writes the header and starts the zlib stream, once the bit depth is known (first strip)
+     */
+    void begin(int depth) {
+        bit_depth = depth;
+        bpp       = channels * bit_depth / 8;
+        rowbytes  = width * bpp;
+        write_header(sink, height, width, bit_depth, channels);
+
+        prev.assign(rowbytes, 0);
+        filtered.resize(rowbytes + 1);
+        scratch.resize(settings.filters & (settings.filters - 1) ? rowbytes + 1 : 0);
+        // IDAT chunks of 64KB
+        out.resize(std::size_t(1) << 16);
+        zlib_header(settings, out.data());
+        out_size = 2;
+        adler    = adler32(0L, Z_NULL, 0);
+        deflater = std::make_unique<DeflateStream>(source, settings);
+    }
+    /**
+     * @brief Writes the compressed bytes of the output buffer in an IDAT chunk
+     */
+    void write_idat() {
+        if (!out_size)
+            return;
+        write_chunk(sink, "IDAT", {{out.data(), out_size}});
+        out_size = 0;
+    }
+    /**
+     * @brief Deflates size bytes, the IDAT chunks are written as the output buffer fills
+     *
+     * @param data
+     * @param size
+     * @param flush Z_NO_FLUSH, or Z_FINISH to end the zlib stream
+     */
+    void deflate_input(const std::uint8_t* data, std::size_t size, int flush) {
+        TORCH_PNG_STAGE_SCOPE(deflate_scope, Deflate, size);
+        auto& stream    = deflater->stream;
+        stream.next_in  = const_cast<Bytef*>(data);
+        stream.avail_in = static_cast<uInt>(size);
+
+        int ret = Z_OK;
+        do {
+            stream.next_out  = out.data() + out_size;
+            stream.avail_out = static_cast<uInt>(out.size() - out_size);
+
+            ret = deflate(&stream, flush);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                throw EncodeError(source, "zlib deflate error (" + std::to_string(ret) + ").");
+
+            out_size = out.size() - stream.avail_out;
+            if (out_size == out.size())
+                write_idat();
+        } while (stream.avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+
+    void write_rows(const torch::Tensor& tensor) {
+        if (closed)
+            throw std::invalid_argument("Unexpected StreamEncoder::write_rows. The encoder is closed.");
+        if (failed)
+            throw EncodeError(source, "Unfinished png. A previous write failed.");
+
+        const auto strip = check_to_cpu(tensor, true);
+        if (strip.size(0) != channels || strip.size(2) != width)
+            throw std::invalid_argument("Unexpected strip dims (" + std::to_string(strip.size(0)) + ", " +
+                                        std::to_string(strip.size(1)) + ", " + std::to_string(strip.size(2)) +
+                                        "). Expects (" + std::to_string(channels) + ", *, " + std::to_string(width) +
+                                        ").");
+        if (y + strip.size(1) > height)
+            throw std::invalid_argument("Unexpected strip height.\nGot(" + std::to_string(strip.size(1)) +
+                                        "). Expects at most the " + std::to_string(height - y) + " remaining rows.");
+
+        const InterleavedRows rows(strip);
+        if (bit_depth && rows.bit_depth() != bit_depth)
+            throw std::invalid_argument("Unexpected torch::Tensor type. The strips of a " +
+                                        std::to_string(bit_depth) + " bit png expect " +
+                                        (bit_depth == 8 ? "torch::kUInt8." : "the types of 16 bit pngs."));
+        try {
+            if (!bit_depth)
+                begin(rows.bit_depth());
+            if (!rows.interleaved())
+                row.resize(rowbytes);
+
+            for (std::int64_t r = 0; r < strip.size(1); ++r) {
+                {
+                    // the conversion of the row (InterleavedRows::row) is recorded on its own
+                    TORCH_PNG_STAGE_SCOPE(filter_scope, Filter, rowbytes);
+                    const auto* pixels = rows.row(r, row.data());
+                    filter_row(settings, pixels, prev.data(), rowbytes, bpp, filtered.data(), scratch.data());
+                    // the strip may be released before the next row is filtered
+                    std::memcpy(prev.data(), pixels, rowbytes);
+                }
+                adler = adler32(adler, filtered.data(), static_cast<uInt>(filtered.size()));
+                deflate_input(filtered.data(), filtered.size(), Z_NO_FLUSH);
+                ++y;
+            }
+        } catch (...) {
+            failed = true;
+            throw;
+        }
+    }
+
+    void close() {
+        if (closed)
+            return;
+        if (failed)
+            throw EncodeError(source, "Unfinished png. A previous write failed.");
+        if (y != height)
+            throw EncodeError(source, "Missing rows.\nGot(" + std::to_string(y) + "). Expects(" +
+                                          std::to_string(height) + ").");
+        try {
+            deflate_input(NULL, 0, Z_FINISH);
+            // zlib footer: adler32 of the filtered rows
+            if (out.size() - out_size < 4)
+                write_idat();
+            put_uint32(out.data() + out_size, static_cast<std::uint32_t>(adler));
+            out_size += 4;
+            write_idat();
+            write_chunk(sink, "IEND", {});
+
+            if (file && (fflush(file.get()) != 0 || ferror(file.get())))
+                throw EncodeError(source, std::string("Cannot write file. ") + std::strerror(errno));
+            file.reset();
+            deflater.reset();
+            closed = true;
+        } catch (...) {
+            failed = true;
+            throw;
+        }
+    }
+
+    std::string     source;
+    Sink            sink;
+    fs::path        filepath;
+    unique_fp       file{NULL, fclose};
+    std::int64_t    height;
+    std::int64_t    width;
+    std::int64_t    channels;
+    DeflateSettings settings;
+    // 0 until the first strip
+    int          bit_depth = 0;
+    std::int64_t bpp       = 0;
+    std::int64_t rowbytes  = 0;
+    // rows written
+    std::int64_t y = 0;
+    bool         closed = false;
+    bool         failed = false;
+    // interleaved row, previous raw row, filtered row (filter type byte first) and adaptive filter candidate
+    std::vector<std::uint8_t> row;
+    std::vector<std::uint8_t> prev;
+    std::vector<std::uint8_t> filtered;
+    std::vector<std::uint8_t> scratch;
+    // deflated bytes of the next IDAT chunk
+    std::vector<std::uint8_t>      out;
+    std::size_t                    out_size = 0;
+    uLong                          adler    = 0;
+    std::unique_ptr<DeflateStream> deflater;
+};
+
+StreamEncoder::StreamEncoder(const fs::path&      filepath,
+                             std::int64_t         height,
+                             std::int64_t         width,
+                             std::int64_t         channels,
+                             const EncodeOptions& options)
+  : impl_{std::make_unique<Impl>(filepath, height, width, channels, options)} {}
+
+StreamEncoder::StreamEncoder(Sink                 sink,
+                             std::int64_t         height,
+                             std::int64_t         width,
+                             std::int64_t         channels,
+                             const EncodeOptions& options)
+  : impl_{std::make_unique<Impl>(sink_source, std::move(sink), height, width, channels, options)} {
+    if (!impl_->sink)
+        throw std::invalid_argument("Unexpected StreamEncoder sink. Expects a callable.");
+}
+
+StreamEncoder::~StreamEncoder() = default;
+
+StreamEncoder::StreamEncoder(StreamEncoder&&) noexcept = default;
+
+StreamEncoder& StreamEncoder::operator=(StreamEncoder&&) noexcept = default;
+
+void StreamEncoder::write_rows(const torch::Tensor& rows) {
+    impl_->write_rows(rows);
+}
+
+void StreamEncoder::close() {
+    impl_->close();
+}
+
+std::int64_t StreamEncoder::rows_written() const noexcept {
+    return impl_ ? impl_->y : 0;
 }
 
 }  // namespace torch_png
\ No newline at end of file
@@ -0,0 +1,246 @@
+#include "torch_png/Prefetcher.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace torch_png {
+
+namespace {
+/**
+ * @brief Decoded item (or its error) waiting to be consumed
+ */
+struct Item {
+    torch::Tensor      tensor;
+    std::exception_ptr error;
+};
+
+typedef std::chrono::steady_clock steady_clock;
+/**
+ * @brief Seconds elapsed since start
+ */
+double seconds_since(steady_clock::time_point start) {
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+struct Prefetcher::Impl {
+    Impl(PathGenerator generator, const PrefetchOptions& options);
+
+    ~Impl();
+    /**
+     * @brief Stops the workers once their current item is decoded and joins them
+     */
+    void shutdown();
+    /**
+     * @brief Worker loop: claims the next item, decodes it and queues it until the stream ends or stop is set
+     */
+    void work();
+    /**
+     * @brief Decodes an image, or a batch of images in a single tensor
+     *
+     * @param decoder decoder of the calling worker
+     * @param filepaths one path per image of the item
+     * @return torch::Tensor
+     */
+    torch::Tensor decode_item(Decoder& decoder, const std::vector<fs::path>& filepaths) const;
+
+    PathGenerator   generator;
+    PrefetchOptions options;
+
+    mutable std::mutex      mutex;
+    std::condition_variable produced_cv;
+    std::condition_variable consumed_cv;
+    // decoded items indexed by their position in the stream
+    std::map<std::uint64_t, Item> ready;
+    // number of items claimed by the workers, produced (queued) and consumed
+    std::uint64_t claimed  = 0;
+    std::uint64_t produced = 0;
+    std::uint64_t consumed = 0;
+    // number of items of the stream, known once the generator is exhausted
+    std::optional<std::uint64_t> end;
+    bool                         stop                  = false;
+    double                       producer_wait_seconds = 0;
+    double                       consumer_wait_seconds = 0;
+
+    std::vector<std::thread> workers;
+};
+
+Prefetcher::Impl::Impl(PathGenerator generator, const PrefetchOptions& options)
+  : generator{std::move(generator)}, options{options} {
+    if (this->options.workers < 0)
+        throw std::invalid_argument("Unexpected PrefetchOptions::workers.\nGot(" + std::to_string(options.workers) +
+                                    "). Expects 0 or more.");
+    if (this->options.batch_size < 0)
+        throw std::invalid_argument("Unexpected PrefetchOptions::batch_size.\nGot(" +
+                                    std::to_string(options.batch_size) + "). Expects 0 or more.");
+    if (!this->options.workers)
+        this->options.workers = std::max(1u, std::thread::hardware_concurrency());
+    if (!this->options.capacity)
+        this->options.capacity = 2 * static_cast<std::size_t>(this->options.workers);
+    // invalid decode options are reported here rather than by every item
+    Decoder check(options.decode_options);
+
+    try {
+        for (int i = 0; i < this->options.workers; ++i)
+            workers.emplace_back([this] { work(); });
+    } catch (...) {
+        // the destructor isn't called when the constructor throws
+        shutdown();
+        throw;
+    }
+}
+
+Prefetcher::Impl::~Impl() {
+    shutdown();
+}
+
+void Prefetcher::Impl::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    consumed_cv.notify_all();
+    produced_cv.notify_all();
+
+    for (auto& worker : workers)
+        if (worker.joinable())
+            worker.join();
+}
+
+void Prefetcher::Impl::work() {
+    Decoder decoder(options.decode_options);
+
+    const auto paths_per_item = static_cast<std::size_t>(std::max<std::int64_t>(1, options.batch_size));
+
+    while (true) {
+        std::vector<fs::path> filepaths;
+        std::uint64_t         index = 0;
+        Item                  item;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // backpressure: the item must fit in the queue once decoded
+            const auto start = steady_clock::now();
+            consumed_cv.wait(lock, [this] { return stop || end || claimed < consumed + options.capacity; });
+            producer_wait_seconds += seconds_since(start);
+
+            if (stop || end)
+                return;
+            // the paths are claimed in order, under the lock
+            try {
+                while (filepaths.size() < paths_per_item) {
+                    auto filepath = generator();
+                    if (!filepath)
+                        break;
+                    filepaths.push_back(std::move(*filepath));
+                }
+            } catch (...) {
+                item.error = std::current_exception();
+            }
+            if (filepaths.empty() && !item.error) {
+                end = claimed;
+                produced_cv.notify_all();
+                return;
+            }
+            index = claimed++;
+            // a short (or failed) claim ends the stream
+            if (filepaths.size() < paths_per_item || item.error)
+                end = claimed;
+        }
+        if (!item.error) {
+            try {
+                item.tensor = decode_item(decoder, filepaths);
+            } catch (...) {
+                item.error = std::current_exception();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.emplace(index, std::move(item));
+            ++produced;
+        }
+        produced_cv.notify_all();
+    }
+}
+
+torch::Tensor Prefetcher::Impl::decode_item(Decoder& decoder, const std::vector<fs::path>& filepaths) const {
+    auto image = decoder.decode(filepaths[0]);
+
+    if (!options.batch_size)
+        return options.pin_memory ? image.pin_memory() : image;
+    // the first image gives the dims of the batch, the others are decoded straight into their slice
+    auto dims = image.sizes().vec();
+    dims.insert(dims.begin(), static_cast<std::int64_t>(filepaths.size()));
+
+    auto batch = torch::empty(
+        dims, torch::TensorOptions().dtype(image.scalar_type()).device(torch::kCPU).pinned_memory(options.pin_memory));
+    batch.select(0, 0).copy_(image);
+
+    for (std::size_t i = 1; i < filepaths.size(); ++i)
+        decoder.decode_into(filepaths[i], batch.select(0, static_cast<std::int64_t>(i)));
+
+    return batch;
+}
+
+Prefetcher::Prefetcher(std::vector<fs::path> filepaths, const PrefetchOptions& options) {
+    auto paths = std::make_shared<std::vector<fs::path>>(std::move(filepaths));
+    // called under the lock of the prefetcher
+    PathGenerator generator = [paths, i = std::size_t(0)]() mutable -> std::optional<fs::path> {
+        if (i == paths->size())
+            return std::nullopt;
+        return (*paths)[i++];
+    };
+    impl_ = std::make_unique<Impl>(std::move(generator), options);
+}
+
+Prefetcher::Prefetcher(PathGenerator generator, const PrefetchOptions& options)
+  : impl_{std::make_unique<Impl>(std::move(generator), options)} {}
+
+Prefetcher::~Prefetcher() = default;
+
+std::optional<torch::Tensor> Prefetcher::next() {
+    auto& impl = *impl_;
+
+    std::unique_lock<std::mutex> lock(impl.mutex);
+
+    const auto start = steady_clock::now();
+    impl.produced_cv.wait(lock, [&impl] {
+        return impl.ready.count(impl.consumed) || (impl.end && impl.consumed == *impl.end);
+    });
+    impl.consumer_wait_seconds += seconds_since(start);
+
+    if (impl.end && impl.consumed == *impl.end)
+        return std::nullopt;
+
+    auto item = std::move(impl.ready.extract(impl.consumed).mapped());
+    ++impl.consumed;
+    lock.unlock();
+    // room for one more item
+    impl.consumed_cv.notify_all();
+
+    if (item.error)
+        std::rethrow_exception(item.error);
+    return item.tensor;
+}
+
+PrefetchStats Prefetcher::stats() const {
+    std::lock_guard<std::mutex> lock(impl_->mutex);
+
+    PrefetchStats stats;
+    stats.queue_depth           = impl_->ready.size();
+    stats.in_flight             = static_cast<std::size_t>(impl_->claimed - impl_->produced);
+    stats.capacity              = impl_->options.capacity;
+    stats.produced              = impl_->produced;
+    stats.consumed              = impl_->consumed;
+    stats.producer_wait_seconds = impl_->producer_wait_seconds;
+    stats.consumer_wait_seconds = impl_->consumer_wait_seconds;
+    return stats;
+}
+
+}  // namespace torch_png
@@ -0,0 +1,389 @@
+#include "torch_png/Shard.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace torch_png {
+
+namespace {
+/**
+ * Shard layout, integers are little endian:
+ *   header : magic "TPNGSHRD", version (u32), reserved (u32)
+ *   pngs   : the png bytes one after the other
+ *   index  : one entry per png: offset (u64), size (u64), height (u32), width (u32),
+ *            channels (u8), bit depth (u8), color type (u8), reserved (5 bytes)
+ *   footer : offset of the index (u64), number of pngs (u64), magic "TPNGINDX"
+ */
+constexpr char          shard_magic[8] = {'T', 'P', 'N', 'G', 'S', 'H', 'R', 'D'};
+constexpr char          index_magic[8] = {'T', 'P', 'N', 'G', 'I', 'N', 'D', 'X'};
+constexpr std::uint32_t shard_version  = 1;
+constexpr std::size_t   header_size    = 16;
+constexpr std::size_t   entry_size     = 32;
+constexpr std::size_t   footer_size    = 24;
+/**
+ * @brief Writes an unsigned integer in little endian byte order
+ */
+template <typename T>
+void store_le(std::uint8_t* out, T value) {
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        out[i] = static_cast<std::uint8_t>(static_cast<std::uint64_t>(value) >> (8 * i));
+}
+/**
+ * @brief Reads an unsigned integer in little endian byte order
+ */
+template <typename T>
+T load_le(const std::uint8_t* bytes) {
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+        value |= static_cast<std::uint64_t>(bytes[i]) << (8 * i);
+    return static_cast<T>(value);
+}
+/**
+ * @brief Index entry of a png from its signature and IHDR chunk, checked like getDims
+ *
+ * @param source reported in the errors
+ * @param data
+ * @param size
+ * @return ShardItem without its offset
+ */
+ShardItem read_item(const std::string& source, const std::uint8_t* data, std::size_t size) {
+    ShardItem item;
+    try {
+        std::tie(item.height, item.width, item.channels, item.bit_depth, item.color_type) =
+            getDims_from_memory(data, size);
+    } catch (const DecodeError& error) {
+        throw DecodeError(source, error.reason());
+    }
+    item.size = size;
+    return item;
+}
+/**
+ * @brief Read only mapping of a whole regular file, unmapped by its destructor
+ */
+class Mapping {
+  public:
+    /**
+     * @param source reported in the errors
+     * @param filepath
+     * @throws DecodeError if the file cannot be opened or mapped, or isn't a regular file
+     */
+    Mapping(const std::string& source, const fs::path& filepath) {
+        const int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw DecodeError(source, std::string("Cannot open file. ") + std::strerror(errno));
+
+        struct stat status;
+        if (fstat(fd, &status) || !S_ISREG(status.st_mode)) {
+            close(fd);
+            throw DecodeError(source, "Not a torch_png shard.");
+        }
+        // an empty file isn't mapped
+        if (!status.st_size) {
+            close(fd);
+            return;
+        }
+        void*     map   = mmap(NULL, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        const int error = errno;
+        close(fd);
+        if (map == MAP_FAILED)
+            throw DecodeError(source, std::string("Cannot map file. ") + std::strerror(error));
+        data_ = static_cast<const std::uint8_t*>(map);
+        size_ = static_cast<std::size_t>(status.st_size);
+    }
+
+    ~Mapping() {
+        if (data_)
+            munmap(const_cast<std::uint8_t*>(data_), size_);
+    }
+
+    Mapping(const Mapping&) = delete;
+
+    Mapping& operator=(const Mapping&) = delete;
+
+    const std::uint8_t* data() const { return data_; }
+
+    std::size_t size() const { return size_; }
+
+  private:
+    const std::uint8_t* data_ = NULL;
+    std::size_t         size_ = 0;
+};
+/**
+ * @brief Advises the kernel about the pages of [offset, offset + size) of a mapping
+ */
+void advise(const std::uint8_t* map, std::uint64_t offset, std::uint64_t size, int advice) {
+    static const std::uint64_t page_size = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+    const auto                 begin     = offset / page_size * page_size;
+    // hints only, errors are ignored
+    madvise(const_cast<std::uint8_t*>(map) + begin, offset + size - begin, advice);
+}
+
+}  // namespace
+
+struct ShardWriter::Impl {
+    Impl(const fs::path& filepath, const EncodeOptions& options) : filepath{filepath}, options{options} {
+        file.reset(std::fopen(filepath.c_str(), "wb"));
+        if (!file)
+            throw EncodeError(filepath.string(), std::string("Cannot open file. ") + std::strerror(errno));
+
+        std::uint8_t header[header_size] = {};
+        std::memcpy(header, shard_magic, 8);
+        store_le(header + 8, shard_version);
+        write(header, header_size);
+    }
+    // an unfinished shard is removed
+    ~Impl() {
+        if (closed)
+            return;
+        file.reset();
+        std::error_code error;
+        fs::remove(filepath, error);
+    }
+
+    void write(const std::uint8_t* data, std::size_t size) {
+        if (std::fwrite(data, 1, size, file.get()) != size) {
+            failed = true;
+            throw EncodeError(filepath.string(), std::string("Cannot write file. ") + std::strerror(errno));
+        }
+        offset += size;
+    }
+
+    void check_open() const {
+        if (closed)
+            throw std::invalid_argument("Unexpected ShardWriter::add. The shard is closed.");
+        if (failed)
+            throw EncodeError(filepath.string(), "Unfinished shard. A previous write failed.");
+    }
+
+    std::size_t append(const std::uint8_t* data, std::size_t size) {
+        check_open();
+        auto item   = read_item(filepath.string() + "[" + std::to_string(items.size()) + "]", data, size);
+        item.offset = offset;
+        write(data, size);
+        items.push_back(item);
+        return items.size() - 1;
+    }
+
+    void close() {
+        if (closed)
+            return;
+        check_open();
+
+        const auto                index_offset = offset;
+        std::vector<std::uint8_t> index(items.size() * entry_size + footer_size, 0);
+        auto*                     entry = index.data();
+        for (const auto& item : items) {
+            store_le(entry, item.offset);
+            store_le(entry + 8, item.size);
+            store_le(entry + 16, static_cast<std::uint32_t>(item.height));
+            store_le(entry + 20, static_cast<std::uint32_t>(item.width));
+            entry[24] = item.channels;
+            entry[25] = item.bit_depth;
+            entry[26] = item.color_type;
+            entry += entry_size;
+        }
+        store_le(entry, index_offset);
+        store_le(entry + 8, static_cast<std::uint64_t>(items.size()));
+        std::memcpy(entry + 16, index_magic, 8);
+        write(index.data(), index.size());
+        // write errors of the buffered bytes are reported here rather than lost when the file is closed
+        if (std::fclose(file.release())) {
+            failed = true;
+            throw EncodeError(filepath.string(), std::string("Cannot write file. ") + std::strerror(errno));
+        }
+        closed = true;
+    }
+
+    fs::path                              filepath;
+    EncodeOptions                         options;
+    std::unique_ptr<FILE, int (*)(FILE*)> file{NULL, std::fclose};
+    // bytes written
+    std::uint64_t          offset = 0;
+    std::vector<ShardItem> items;
+    bool                   closed = false;
+    bool                   failed = false;
+};
+
+ShardWriter::ShardWriter(const fs::path& filepath, const EncodeOptions& options)
+  : impl_{std::make_unique<Impl>(filepath, options)} {}
+
+ShardWriter::~ShardWriter() = default;
+
+ShardWriter::ShardWriter(ShardWriter&&) noexcept = default;
+
+ShardWriter& ShardWriter::operator=(ShardWriter&&) noexcept = default;
+
+std::size_t ShardWriter::add(const torch::Tensor& tensor) {
+    impl_->check_open();
+    const auto bytes = encode_to_memory(tensor, impl_->options);
+    return impl_->append(bytes.data_ptr<std::uint8_t>(), static_cast<std::size_t>(bytes.numel()));
+}
+
+std::size_t ShardWriter::add_batch(const torch::Tensor& tensor, int threads) {
+    impl_->check_open();
+    const auto  encoded = encode_batch_to_memory(tensor, impl_->options, threads);
+    std::size_t first   = impl_->items.size();
+    for (const auto& bytes : encoded)
+        impl_->append(bytes.data_ptr<std::uint8_t>(), static_cast<std::size_t>(bytes.numel()));
+    return first;
+}
+
+std::size_t ShardWriter::add_encoded(const std::uint8_t* data, std::size_t size) {
+    return impl_->append(data, size);
+}
+
+void ShardWriter::close() {
+    impl_->close();
+}
+
+std::size_t ShardWriter::size() const noexcept {
+    return impl_ ? impl_->items.size() : 0;
+}
+
+struct ShardReader::Impl {
+    Impl(const fs::path& filepath, ShardAccess access, const DecodeOptions& options)
+      : source{filepath.string()},
+        access{access},
+        options{options},
+        mapping{source, filepath},
+        data{mapping.data()},
+        size{mapping.size()} {
+        // the mapping is a member: it is unmapped if the checks below throw
+        if (size < header_size + footer_size)
+            throw DecodeError(source, "Not a torch_png shard.");
+        advise(data, 0, size, access == ShardAccess::Random ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+        read_index();
+    }
+    /**
+     * @brief Reads and checks the header, the footer and the index entries
+     */
+    void read_index() {
+        if (std::memcmp(data, shard_magic, 8))
+            throw DecodeError(source, "Not a torch_png shard.");
+        if (load_le<std::uint32_t>(data + 8) != shard_version)
+            throw DecodeError(source, "Unsupported shard version " + std::to_string(load_le<std::uint32_t>(data + 8)) +
+                                          ".");
+        const auto* footer = data + size - footer_size;
+        if (std::memcmp(footer + 16, index_magic, 8))
+            throw DecodeError(source, "Missing shard index. The shard wasn't closed.");
+
+        const auto index_offset = load_le<std::uint64_t>(footer);
+        const auto count        = load_le<std::uint64_t>(footer + 8);
+        if (index_offset < header_size || index_offset > size - footer_size ||
+            (size - footer_size - index_offset) / entry_size != count ||
+            (size - footer_size - index_offset) % entry_size)
+            throw DecodeError(source, "Invalid shard index.");
+
+        items.resize(count);
+        const auto* entry = data + index_offset;
+        for (auto& item : items) {
+            item.offset     = load_le<std::uint64_t>(entry);
+            item.size       = load_le<std::uint64_t>(entry + 8);
+            item.height     = static_cast<std::int32_t>(load_le<std::uint32_t>(entry + 16));
+            item.width      = static_cast<std::int32_t>(load_le<std::uint32_t>(entry + 20));
+            item.channels   = entry[24];
+            item.bit_depth  = entry[25];
+            item.color_type = entry[26];
+            if (item.offset < header_size || item.offset > index_offset || item.size > index_offset - item.offset)
+                throw DecodeError(source, "Invalid shard index.");
+            entry += entry_size;
+        }
+    }
+
+    void check_index(std::size_t index) const {
+        if (index >= items.size())
+            throw std::invalid_argument("Unexpected shard index.\nGot(" + std::to_string(index) + "). Expects [0, " +
+                                        std::to_string(items.size()) + ").");
+    }
+    /**
+     * @brief Buffer of a png in the mapping, its errors are reported as <shard path>[index]
+     */
+    PngBuffer buffer(std::size_t index) const {
+        check_index(index);
+        const auto& item = items[index];
+        return {data + item.offset, static_cast<std::size_t>(item.size), source + "[" + std::to_string(index) + "]"};
+    }
+
+    std::string            source;
+    ShardAccess            access;
+    DecodeOptions          options;
+    Mapping                mapping;
+    const std::uint8_t*    data;
+    std::size_t            size;
+    std::vector<ShardItem> items;
+};
+
+ShardReader::ShardReader(const fs::path& filepath, ShardAccess access, const DecodeOptions& options)
+  : impl_{std::make_unique<Impl>(filepath, access, options)} {}
+
+ShardReader::~ShardReader() = default;
+
+ShardReader::ShardReader(ShardReader&&) noexcept = default;
+
+ShardReader& ShardReader::operator=(ShardReader&&) noexcept = default;
+
+std::size_t ShardReader::size() const noexcept {
+    return impl_ ? impl_->items.size() : 0;
+}
+
+const ShardItem& ShardReader::item(std::size_t index) const {
+    impl_->check_index(index);
+    return impl_->items[index];
+}
+
+torch::Tensor ShardReader::decode(std::size_t index) const {
+    const auto buffer = impl_->buffer(index);
+    if (impl_->access == ShardAccess::Random)
+        advise(impl_->data, impl_->items[index].offset, buffer.size, MADV_WILLNEED);
+    // the errors are reported with the shard path and the index of the png rather than "<memory>"
+    try {
+        return decode_from_memory(buffer.data, buffer.size, impl_->options);
+    } catch (const DecodeError& error) {
+        throw DecodeError(buffer.source, error.reason());
+    }
+}
+
+torch::Tensor ShardReader::decode_batch(const std::vector<std::size_t>& indices, BatchPolicy policy) const {
+    std::vector<PngBuffer> buffers;
+    buffers.reserve(indices.size());
+    for (const auto index : indices) {
+        buffers.push_back(impl_->buffer(index));
+        // the reads of the scattered items are issued up front rather than one page fault at a time
+        if (impl_->access == ShardAccess::Random)
+            advise(impl_->data, impl_->items[index].offset, impl_->items[index].size, MADV_WILLNEED);
+    }
+    return decode_batch_from_memory(buffers, policy, impl_->options);
+}
+
+torch::Tensor ShardReader::decode_range(std::size_t first, std::size_t count, BatchPolicy policy) const {
+    const auto& items = impl_->items;
+    if (first > items.size() || count > items.size() - first)
+        throw std::invalid_argument("Unexpected shard range [" + std::to_string(first) + ", " +
+                                    std::to_string(first + count) + ").\nExpects a range of [0, " +
+                                    std::to_string(items.size()) + ").");
+    // the following range is read by the kernel while this one is decoded
+    const auto next = first + count;
+    if (impl_->access == ShardAccess::Sequential && next < items.size()) {
+        const auto& last = items[std::min(next + count, items.size()) - 1];
+        advise(impl_->data, items[next].offset, last.offset + last.size - items[next].offset, MADV_WILLNEED);
+    }
+    std::vector<std::size_t> indices(count);
+    std::iota(indices.begin(), indices.end(), first);
+    return decode_batch(indices, policy);
+}
+
+}  // namespace torch_png
@@ -0,0 +1,167 @@
+#include "torch_png/Stats.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace torch_png {
+
+#ifdef TORCH_PNG_STATS
+
+namespace {
+
+constexpr std::size_t stage_count = 6;
+/**
+ * @brief Counters of a stage. Only the owner thread adds to them, the atomics let stats read them concurrently.
+ */
+struct Counter {
+    std::atomic<std::uint64_t> calls{0};
+    std::atomic<std::uint64_t> nanoseconds{0};
+    std::atomic<std::uint64_t> bytes{0};
+};
+
+typedef std::array<Counter, stage_count> Counters;
+/**
+ * @brief Counters of the running threads, and the sum of the counters of the threads that exited
+ */
+struct Registry {
+    std::mutex             mutex;
+    std::vector<Counters*> threads;
+    Counters               exited;
+};
+
+Registry& registry() {
+    static Registry registry;
+    return registry;
+}
+/**
+ * @brief Adds the counters of source to destination
+ */
+void accumulate(const Counters& source, Counters& destination) {
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        destination[i].calls += source[i].calls.load(std::memory_order_relaxed);
+        destination[i].nanoseconds += source[i].nanoseconds.load(std::memory_order_relaxed);
+        destination[i].bytes += source[i].bytes.load(std::memory_order_relaxed);
+    }
+}
+/**
+ * @brief Zeroes counters
+ */
+void reset(Counters& counters) {
+    for (auto& counter : counters) {
+        counter.calls       = 0;
+        counter.nanoseconds = 0;
+        counter.bytes       = 0;
+    }
+}
+/**
+ * @brief Counters of a thread, registered while the thread runs
+ */
+struct ThreadCounters {
+    ThreadCounters() {
+        auto&                       all = registry();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        all.threads.push_back(&counters);
+    }
+
+    ~ThreadCounters() {
+        auto&                       all = registry();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        accumulate(counters, all.exited);
+        all.threads.erase(std::find(all.threads.begin(), all.threads.end(), &counters));
+    }
+
+    Counters counters;
+    // sum of the recorded durations, see detail::recorded_nanoseconds
+    std::uint64_t recorded = 0;
+};
+
+ThreadCounters& thread_counters() {
+    thread_local ThreadCounters counters;
+    return counters;
+}
+
+}  // namespace
+
+bool stats_enabled() noexcept {
+    return true;
+}
+
+Stats stats() {
+    Counters total;
+    {
+        auto&                       all = registry();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        accumulate(all.exited, total);
+        for (const auto* counters : all.threads)
+            accumulate(*counters, total);
+    }
+    Stats       stats;
+    StageStats* stages[stage_count] = {
+        &stats.header, &stats.inflate, &stats.convert, &stats.filter, &stats.deflate, &stats.io};
+
+    for (std::size_t i = 0; i < stage_count; ++i) {
+        stages[i]->calls   = total[i].calls;
+        stages[i]->seconds = static_cast<double>(total[i].nanoseconds) * 1e-9;
+        stages[i]->bytes   = total[i].bytes;
+    }
+    return stats;
+}
+
+void reset_stats() {
+    auto&                       all = registry();
+    std::lock_guard<std::mutex> lock(all.mutex);
+
+    reset(all.exited);
+    // a section recorded by a running thread meanwhile may be partially reset
+    for (auto* counters : all.threads)
+        reset(*counters);
+}
+
+namespace detail {
+
+std::uint64_t recorded_nanoseconds() noexcept {
+    return thread_counters().recorded;
+}
+
+void record(Stage stage, std::uint64_t nanoseconds, std::uint64_t nested_nanoseconds, std::uint64_t bytes) noexcept {
+    auto& thread = thread_counters();
+    // the clock granularity may make a section shorter than the sections nested in it
+    const auto exclusive = nanoseconds > nested_nanoseconds ? nanoseconds - nested_nanoseconds : 0;
+    auto&      counter   = thread.counters[static_cast<std::size_t>(stage)];
+
+    counter.calls.fetch_add(1, std::memory_order_relaxed);
+    counter.nanoseconds.fetch_add(exclusive, std::memory_order_relaxed);
+    counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    thread.recorded += exclusive;
+}
+
+}  // namespace detail
+
+#else
+
+bool stats_enabled() noexcept {
+    return false;
+}
+
+Stats stats() {
+    return Stats();
+}
+
+void reset_stats() {}
+
+namespace detail {
+
+std::uint64_t recorded_nanoseconds() noexcept {
+    return 0;
+}
+
+void record(Stage, std::uint64_t, std::uint64_t, std::uint64_t) noexcept {}
+
+}  // namespace detail
+
+#endif
+
+}  // namespace torch_png
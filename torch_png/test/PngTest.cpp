@@ -2,14 +2,22 @@
 #include <gtest/gtest.h>
 
 #include "torch_png/Png.hpp"
+#include "torch_png/Prefetcher.hpp"
+#include "torch_png/Shard.hpp"
+#include "torch_png/Stats.hpp"
 
 #include <torch/torch.h>
 
 #include <algorithm>
+#include <fstream>
 #include <initializer_list>
+#include <iterator>
 #include <vector>
 
 #include <sstream>
+#include <thread>
+
+#include <sys/stat.h>
 
 namespace torch_typing {
 
@@ -149,6 +157,78 @@ torch::Tensor make_tensor_values(std::vector<T>                             valu
 
 namespace fs = std::filesystem;
 
+namespace test_io {
+/**
+ * @brief reads the whole content of a file
+ *
+ * @param filepath
+ * @return std::vector<std::uint8_t> file bytes
+ */
+inline std::vector<std::uint8_t> read_bytes(const fs::path& filepath) {
+    std::ifstream file(filepath, std::ios::binary);
+    return std::vector<std::uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * @brief writes a png with libpng, for the formats torch_png::encode doesn't produce
+ *
+ * @param filepath
+ * @param width
+ * @param bit_depth
+ * @param color_type
+ * @param rows packed png rows
+ * @param palette PLTE entries, for PNG_COLOR_TYPE_PALETTE
+ * @param alphas tRNS entries, for PNG_COLOR_TYPE_PALETTE
+ * @param interlace PNG_INTERLACE_NONE or PNG_INTERLACE_ADAM7
+ */
+inline void write_png(const fs::path&                             filepath,
+                      int                                         width,
+                      int                                         bit_depth,
+                      int                                         color_type,
+                      const std::vector<std::vector<std::uint8_t>>& rows,
+                      const std::vector<png_color>&               palette   = {},
+                      const std::vector<std::uint8_t>&            alphas    = {},
+                      int                                         interlace = PNG_INTERLACE_NONE) {
+    FILE* fp      = fopen(filepath.c_str(), "wb");
+    auto  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    auto  info    = png_create_info_struct(png_ptr);
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info, width, static_cast<int>(rows.size()), bit_depth, color_type, interlace,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    if (!palette.empty())
+        png_set_PLTE(png_ptr, info, palette.data(), static_cast<int>(palette.size()));
+    if (!alphas.empty())
+        png_set_tRNS(png_ptr, info, alphas.data(), static_cast<int>(alphas.size()), NULL);
+    png_write_info(png_ptr, info);
+    // libpng extracts the pixels of each pass from the full rows
+    const int passes = interlace == PNG_INTERLACE_ADAM7 ? png_set_interlace_handling(png_ptr) : 1;
+    for (int pass = 0; pass < passes; ++pass)
+        for (const auto& row : rows)
+            png_write_row(png_ptr, row.data());
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info);
+    fclose(fp);
+}
+
+/**
+ * @brief png rows of a {height, width, channels} torch::kUInt8 tensor
+ *
+ * @param hwc
+ * @return std::vector<std::vector<std::uint8_t>>
+ */
+inline std::vector<std::vector<std::uint8_t>> to_rows(const torch::Tensor& hwc) {
+    const auto contiguous = hwc.contiguous();
+    const auto rowbytes   = contiguous.size(1) * contiguous.size(2);
+    const auto data       = contiguous.data_ptr<std::uint8_t>();
+
+    std::vector<std::vector<std::uint8_t>> rows;
+    for (std::int64_t y = 0; y < contiguous.size(0); ++y)
+        rows.emplace_back(data + y * rowbytes, data + (y + 1) * rowbytes);
+    return rows;
+}
+
+}  // namespace test_io
+
 class PngErrorsTest : public ::testing::Test {
   protected:
     // where the png tests will be stored (and deleted)
@@ -234,9 +314,1136 @@ TEST_F(PngErrorsTest, testReadWritePngBatchedTensorsGray) {
     fs::remove(fp / "g_1.png");
 }
 
+TEST_F(PngErrorsTest, testEncodeBatchResults) {
+    // strided batch (no item is contiguous) of gray images
+    const auto batch = torch::arange(4 * 5 * 6, torch::kInt32).remainder(256).to(torch::kUInt8).view({4, 1, 6, 5});
+    const auto images = batch.permute({0, 1, 3, 2});
+
+    const auto results = torch_png::encode_batch(fp / "strided.png", images, "_", torch_png::EncodeOptions(), 2);
+    ASSERT_EQ(results.size(), 4u);
+    for (std::int64_t b = 0; b < 4; ++b) {
+        const auto& result = results[b];
+        EXPECT_TRUE(result.ok());
+        EXPECT_EQ(result.filepath, fp / ("strided_" + std::to_string(b) + ".png"));
+        EXPECT_EQ(result.bytes, fs::file_size(result.filepath));
+        EXPECT_TRUE(torch_png::decode(result.filepath).eq(images[b]).all().item<bool>());
+        fs::remove(result.filepath);
+    }
+    // a failing item doesn't stop the others
+    const auto missing = torch_png::encode_batch(fp / "missing_dir" / "item.png", images);
+    ASSERT_EQ(missing.size(), 4u);
+    for (const auto& result : missing) {
+        EXPECT_FALSE(result.ok());
+        EXPECT_THROW(std::rethrow_exception(result.error), torch_png::EncodeError);
+    }
+    EXPECT_THROW(torch_png::encode_batch(fp / "item.png", images, "_", torch_png::EncodeOptions(), -1),
+                 std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeLayouts) {
+    for (std::int64_t channels = 1; channels <= 4; ++channels) {
+        // {channels, rows=5, columns=7} image with distinct values per channel
+        const auto image = torch::arange(channels * 5 * 7, torch::TensorOptions().dtype(torch::kUInt8))
+                               .reshape({channels, 5, 7});
+        torch_png::encode(fp / "layout.png", image);
+        // planar decode (default)
+        const auto image_chw = torch_png::decode(fp / "layout.png");
+        EXPECT_TRUE(image_chw.eq(image).all().item<bool>());
+        // interleaved decode
+        torch_png::DecodeOptions options;
+        options.layout       = torch_png::Layout::HWC;
+        const auto image_hwc = torch_png::decode(fp / "layout.png", options);
+        ASSERT_EQ(image_hwc.size(2), channels);
+        EXPECT_TRUE(image_hwc.permute({2, 0, 1}).eq(image).all().item<bool>());
+        fs::remove(fp / "layout.png");
+    }
+}
+
+TEST_F(PngErrorsTest, testEncodeStrides) {
+    for (std::int64_t channels = 1; channels <= 4; ++channels) {
+        const auto image = torch::arange(channels * 5 * 8, torch::TensorOptions().dtype(torch::kUInt8))
+                               .reshape({channels, 5, 8});
+        // contiguous CHW, contiguous HWC viewed as CHW and a strided view
+        const std::vector<torch::Tensor> inputs = {
+            image, image.permute({1, 2, 0}).contiguous().permute({2, 0, 1}), image.slice(2, 0, 8, 2)};
+
+        for (const auto& input : inputs) {
+            torch_png::encode(fp / "strides.png", input);
+            EXPECT_TRUE(torch_png::decode(fp / "strides.png").eq(input).all().item<bool>());
+            fs::remove(fp / "strides.png");
+        }
+    }
+}
+
+TEST_F(PngErrorsTest, testDecodeBatch) {
+    const auto options = torch::TensorOptions().dtype(torch::kUInt8);
+    // two {channels=3, rows=4, columns=5} images and a smaller {channels=3, rows=2, columns=3} one
+    const auto image_0 = torch::arange(3 * 4 * 5, options).reshape({3, 4, 5});
+    const auto image_1 = torch::arange(100, 100 + 3 * 4 * 5, options).reshape({3, 4, 5});
+    const auto image_2 = torch::arange(3 * 2 * 3, options).reshape({3, 2, 3});
+    torch_png::encode(fp / "batch_0.png", image_0);
+    torch_png::encode(fp / "batch_1.png", image_1);
+    torch_png::encode(fp / "batch_2.png", image_2);
+    // same dims
+    const auto batch = torch_png::decode_batch({fp / "batch_0.png", fp / "batch_1.png"});
+    ASSERT_EQ(batch.dim(), 4);
+    EXPECT_TRUE(batch.index({0, torch_png::idx::Ellipsis}).eq(image_0).all().item<bool>());
+    EXPECT_TRUE(batch.index({1, torch_png::idx::Ellipsis}).eq(image_1).all().item<bool>());
+    // different dims
+    EXPECT_THROW(torch_png::decode_batch({fp / "batch_0.png", fp / "batch_2.png"}), std::invalid_argument);
+    const auto padded =
+        torch_png::decode_batch({fp / "batch_2.png", fp / "batch_0.png"}, torch_png::BatchPolicy::Pad);
+    ASSERT_EQ(padded.size(2), 4);
+    ASSERT_EQ(padded.size(3), 5);
+    const auto padded_2 = padded.index({0, torch_png::idx::Ellipsis});
+    EXPECT_TRUE(padded_2.narrow(1, 0, 2).narrow(2, 0, 3).eq(image_2).all().item<bool>());
+    EXPECT_TRUE(padded_2.narrow(1, 2, 2).eq(0).all().item<bool>());
+    EXPECT_TRUE(padded_2.narrow(2, 3, 2).eq(0).all().item<bool>());
+    EXPECT_TRUE(padded.index({1, torch_png::idx::Ellipsis}).eq(image_0).all().item<bool>());
+
+    fs::remove(fp / "batch_0.png");
+    fs::remove(fp / "batch_1.png");
+    fs::remove(fp / "batch_2.png");
+}
+
+TEST_F(PngErrorsTest, testDecodeFromMemory) {
+    // create a {channels=3, rows=1, columns=3} rgb image
+    const auto image_rgb =
+        torch_create::make_tensor_values<std::uint8_t>({255, 0, 100, 100, 0, 255, 255, 255, 255}, {3, 1, 3});
+    // encode it and load the png bytes in memory
+    torch_png::encode(fp / "mem_rgb.png", image_rgb);
+    auto bytes = test_io::read_bytes(fp / "mem_rgb.png");
+    fs::remove(fp / "mem_rgb.png");
+    // decode it from a raw buffer
+    const auto image_rgb2 = torch_png::decode_from_memory(bytes.data(), bytes.size());
+    EXPECT_TRUE(image_rgb2.eq(image_rgb).all().item<bool>());
+    // decode it from a tensor of bytes
+    const auto bytes_tensor = torch::from_blob(
+        bytes.data(), {static_cast<std::int64_t>(bytes.size())}, torch::TensorOptions().dtype(torch::kUInt8));
+    const auto image_rgb3 = torch_png::decode_from_memory(bytes_tensor);
+    EXPECT_TRUE(image_rgb3.eq(image_rgb).all().item<bool>());
+    // bytes must be torch::kUInt8
+    EXPECT_THROW(torch_png::decode_from_memory(bytes_tensor.to(torch::kInt32)), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeFileInputs) {
+    const auto image = torch::arange(3 * 40 * 30, torch::kInt32).remainder(251).to(torch::kUInt8).view({3, 40, 30});
+    const auto bytes = torch_png::encode_to_memory(image);
+    // regular files are mapped
+    torch_png::encode(fp / "mapped.png", image);
+    EXPECT_TRUE(torch_png::decode(fp / "mapped.png").eq(image).all().item<bool>());
+    EXPECT_TRUE(torch_png::decode_from_memory(bytes).eq(torch_png::decode(fp / "mapped.png")).all().item<bool>());
+    fs::remove(fp / "mapped.png");
+    // empty files can't be mapped and aren't pngs
+    std::ofstream(fp / "empty.png").close();
+    try {
+        torch_png::decode(fp / "empty.png");
+        FAIL() << "Expected torch_png::DecodeError";
+    } catch (const torch_png::DecodeError& error) {
+        EXPECT_EQ(error.source(), (fp / "empty.png").string());
+        EXPECT_EQ(error.reason(), "Not a png file.");
+    }
+    fs::remove(fp / "empty.png");
+    // pipes are read
+    const auto fifo = fp / "fifo.png";
+    fs::remove(fifo);
+    ASSERT_EQ(mkfifo(fifo.c_str(), 0600), 0);
+    std::thread writer([&] {
+        std::ofstream(fifo, std::ios::binary)
+            .write(reinterpret_cast<const char*>(bytes.data_ptr<std::uint8_t>()), bytes.numel());
+    });
+    const auto from_fifo = torch_png::decode(fifo);
+    writer.join();
+    EXPECT_TRUE(from_fifo.eq(image).all().item<bool>());
+    fs::remove(fifo);
+}
+
+TEST_F(PngErrorsTest, testEncodeToMemory) {
+    // create a {channels=4, rows=1, columns=3} rgba image
+    const auto image_rgba =
+        torch_create::make_tensor_values<std::uint8_t>({255, 0, 100, 100, 0, 255, 0, 100, 255, 0, 100, 255}, {4, 1, 3});
+    // encode it in memory
+    const auto bytes = torch_png::encode_to_memory(image_rgba);
+    EXPECT_EQ(bytes.dim(), 1);
+    EXPECT_TRUE(bytes.dtype() == torch::kUInt8);
+    // the bytes match the ones written in a file
+    torch_png::encode(fp / "mem_rgba.png", image_rgba);
+    const auto file_bytes = test_io::read_bytes(fp / "mem_rgba.png");
+    fs::remove(fp / "mem_rgba.png");
+    ASSERT_EQ(bytes.numel(), static_cast<std::int64_t>(file_bytes.size()));
+    EXPECT_TRUE(std::equal(file_bytes.begin(), file_bytes.end(), bytes.data_ptr<std::uint8_t>()));
+    // and decode back to the same image
+    EXPECT_TRUE(torch_png::decode_from_memory(bytes).eq(image_rgba).all().item<bool>());
+
+    // incompressible pixels: the buffer is reserved once, whatever the length of the zlib stored blocks
+    std::vector<std::uint8_t> noise(3 * 300 * 200);
+    std::uint32_t             state = 1;
+    for (auto& sample : noise) {
+        state  = state * 1664525u + 1013904223u;
+        sample = static_cast<std::uint8_t>(state >> 24);
+    }
+    const auto image = torch::from_blob(noise.data(), {3, 300, 200}, torch::kUInt8);
+    for (const int mem_level : {1, 8}) {
+        for (const int threads : {1, 2}) {
+            torch_png::EncodeOptions options;
+            options.compression_level = 9;
+            options.mem_level         = mem_level;
+            options.filters           = PNG_FILTER_NONE;
+            options.threads           = threads;
+            torch_png::Encoder encoder(options);
+            const auto&        buffer = encoder.encode_to_buffer(image);
+            // a reallocation would double the capacity
+            EXPECT_LT(buffer.capacity(), buffer.size() * 3 / 2) << mem_level << " " << threads;
+            EXPECT_TRUE(torch_png::decode_from_memory(buffer.data(), buffer.size()).eq(image).all().item<bool>());
+        }
+    }
+}
+
+TEST_F(PngErrorsTest, testEncodeOptions) {
+    const auto image = torch::arange(3 * 32 * 32, torch::TensorOptions().dtype(torch::kInt32))
+                           .to(torch::kUInt8)
+                           .reshape({3, 32, 32});
+    torch_png::EncodeOptions stored;
+    stored.compression_level = 0;
+    stored.filters           = PNG_FILTER_NONE;
+    // every preset round trips
+    for (const auto& options : {torch_png::EncodeOptions(), torch_png::EncodeOptions::fast(),
+                                torch_png::EncodeOptions::best(), stored}) {
+        const auto bytes = torch_png::encode_to_memory(image, options);
+        EXPECT_TRUE(torch_png::decode_from_memory(bytes).eq(image).all().item<bool>());
+    }
+    // stored data is larger than compressed data
+    EXPECT_GT(torch_png::encode_to_memory(image, stored).numel(),
+              torch_png::encode_to_memory(image, torch_png::EncodeOptions::best()).numel());
+    // out of range settings
+    torch_png::EncodeOptions bad_level;
+    bad_level.compression_level = 10;
+    EXPECT_THROW(torch_png::encode_to_memory(image, bad_level), std::invalid_argument);
+    torch_png::EncodeOptions bad_filters;
+    bad_filters.filters = 0x01;
+    EXPECT_THROW(torch_png::encode_to_memory(image, bad_filters), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testEncodeParallel) {
+    // several bands of rows, planar and interleaved in memory
+    const auto image = torch::arange(3 * 1000 * 400, torch::TensorOptions().dtype(torch::kInt32))
+                           .to(torch::kUInt8)
+                           .reshape({3, 1000, 400});
+    const auto interleaved = image.permute({1, 2, 0}).contiguous().permute({2, 0, 1});
+    const auto gray        = image.select(0, 1).unsqueeze(0);
+
+    torch_png::EncodeOptions paeth;
+    paeth.filters = PNG_FILTER_PAETH;
+    torch_png::EncodeOptions stored;
+    stored.compression_level = 0;
+    stored.filters           = PNG_FILTER_NONE;
+    // raw deflate streams don't accept 8 window bits
+    torch_png::EncodeOptions small_window;
+    small_window.window_bits = 8;
+
+    for (auto options : {torch_png::EncodeOptions(), torch_png::EncodeOptions::fast(),
+                         torch_png::EncodeOptions::best(), paeth, stored, small_window}) {
+        for (const int threads : {0, 2, 4}) {
+            options.threads = threads;
+            for (const auto& tensor : {image, interleaved, gray}) {
+                // decoded by libpng
+                const auto bytes = torch_png::encode_to_memory(tensor, options);
+                EXPECT_TRUE(torch_png::decode_from_memory(bytes).eq(tensor).all().item<bool>());
+            }
+        }
+    }
+    // file output
+    torch_png::EncodeOptions options;
+    options.threads = 2;
+    torch_png::encode(fp / "parallel.png", image, options);
+    EXPECT_TRUE(torch_png::decode(fp / "parallel.png").eq(image).all().item<bool>());
+
+    options.threads = -1;
+    EXPECT_THROW(torch_png::encode_to_memory(image, options), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testStreamEncoder) {
+    const auto image = torch::arange(3 * 300 * 200, torch::TensorOptions().dtype(torch::kInt32))
+                           .to(torch::kUInt8)
+                           .reshape({3, 300, 200});
+    // strips of various heights, planar and interleaved in memory, several IDAT chunks
+    const auto interleaved = image.permute({1, 2, 0}).contiguous().permute({2, 0, 1});
+    {
+        torch_png::StreamEncoder encoder(fp / "stream.png", 300, 200, 3);
+        std::int64_t             y = 0;
+        for (const std::int64_t rows : {1, 50, 0, 149, 100}) {
+            encoder.write_rows((y % 2 ? interleaved : image).narrow(1, y, rows));
+            y += rows;
+            EXPECT_EQ(encoder.rows_written(), y);
+        }
+        encoder.close();
+        // closing twice is a no op
+        encoder.close();
+    }
+    EXPECT_TRUE(torch_png::decode(fp / "stream.png").eq(image).all().item<bool>());
+    // memory sink, 16 bit, adaptive and single filters
+    const auto image16 = image.to(torch::kInt32).mul(257);
+    torch_png::EncodeOptions paeth;
+    paeth.filters = PNG_FILTER_PAETH;
+    // raw deflate streams don't accept 8 window bits
+    torch_png::EncodeOptions small_window;
+    small_window.window_bits = 8;
+
+    for (const auto& options : {torch_png::EncodeOptions(), torch_png::EncodeOptions::fast(), paeth, small_window}) {
+        for (const auto& tensor : {image, image16}) {
+            std::vector<std::uint8_t> bytes;
+            torch_png::StreamEncoder  encoder(
+                [&bytes](const std::uint8_t* data, std::size_t size) { bytes.insert(bytes.end(), data, data + size); },
+                300, 200, 3, options);
+            for (std::int64_t y = 0; y < 300; y += 60)
+                encoder.write_rows(tensor.narrow(1, y, 60));
+            encoder.close();
+            EXPECT_TRUE(torch_png::decode_from_memory(bytes.data(), bytes.size()).eq(tensor).all().item<bool>());
+        }
+    }
+    // errors
+    EXPECT_THROW(torch_png::StreamEncoder(fp / "stream.png", 0, 200, 3), std::invalid_argument);
+    EXPECT_THROW(torch_png::StreamEncoder(fp / "stream.png", 300, 200, 5), std::invalid_argument);
+    EXPECT_THROW(torch_png::StreamEncoder(torch_png::Sink(), 300, 200, 3), std::invalid_argument);
+    EXPECT_THROW(torch_png::StreamEncoder(fp / "missing" / "stream.png", 300, 200, 3), torch_png::EncodeError);
+    {
+        torch_png::StreamEncoder encoder(fp / "unfinished.png", 300, 200, 3);
+        encoder.write_rows(image.narrow(1, 0, 100));
+        // wrong channels, width, type, too many rows
+        EXPECT_THROW(encoder.write_rows(image.narrow(0, 0, 1).narrow(1, 100, 10)), std::invalid_argument);
+        EXPECT_THROW(encoder.write_rows(image.narrow(2, 0, 100).narrow(1, 100, 10)), std::invalid_argument);
+        EXPECT_THROW(encoder.write_rows(image16.narrow(1, 100, 10)), std::invalid_argument);
+        EXPECT_THROW(encoder.write_rows(image.narrow(1, 0, 201)), std::invalid_argument);
+        EXPECT_EQ(encoder.rows_written(), 100);
+        EXPECT_THROW(encoder.close(), torch_png::EncodeError);
+        EXPECT_TRUE(fs::exists(fp / "unfinished.png"));
+    }
+    // the unfinished png is removed
+    EXPECT_FALSE(fs::exists(fp / "unfinished.png"));
+}
+
+TEST_F(PngErrorsTest, testDecode16Bit) {
+    // covers the whole 16 bit range, both bytes of the samples differ
+    const auto image = torch::arange(3 * 128 * 171, torch::TensorOptions().dtype(torch::kInt32))
+                           .mul(3)
+                           .remainder(65536)
+                           .reshape({3, 128, 171});
+    const auto bytes = torch_png::encode_to_memory(image);
+    // int32 by default
+    const auto decoded = torch_png::decode_from_memory(bytes);
+    EXPECT_EQ(decoded.scalar_type(), torch::kInt32);
+    EXPECT_TRUE(decoded.eq(image).all().item<bool>());
+
+    torch_png::DecodeOptions options;
+    options.layout = torch_png::Layout::HWC;
+    EXPECT_TRUE(torch_png::decode_from_memory(bytes, options).eq(image.permute({1, 2, 0})).all().item<bool>());
+    // normalized float
+    options.layout = torch_png::Layout::CHW;
+    options.dtype  = torch::kFloat;
+    const auto normalized = torch_png::decode_from_memory(bytes, options);
+    EXPECT_LT(normalized.sub(image.to(torch::kFloat).div(65535)).abs().max().item<float>(), 1e-6);
+    // 8 most significant bits
+    options.dtype = torch::kUInt8;
+    EXPECT_TRUE(torch_png::decode_from_memory(bytes, options).eq(image.div(256).to(torch::kUInt8)).all().item<bool>());
+    // float and int16 round trip through 16 bit pngs
+    EXPECT_TRUE(torch_png::decode_from_memory(torch_png::encode_to_memory(normalized)).eq(image).all().item<bool>());
+    options.dtype          = torch::kInt16;
+    const auto int16       = torch_png::decode_from_memory(bytes, options);
+    options.dtype          = torch::kInt32;
+    const auto int16_bytes = torch_png::encode_to_memory(int16);
+    EXPECT_TRUE(torch_png::decode_from_memory(int16_bytes, options).eq(image).all().item<bool>());
+    // 8 bit pngs to float
+    const auto image8 = image.remainder(256).to(torch::kUInt8);
+    options.dtype     = torch::kFloat;
+    const auto float8 = torch_png::decode_from_memory(torch_png::encode_to_memory(image8), options);
+    EXPECT_LT(float8.sub(image8.to(torch::kFloat).div(255)).abs().max().item<float>(), 1e-6);
+    // multithreaded encoding
+    torch_png::EncodeOptions parallel;
+    parallel.threads = 2;
+    const auto parallel_bytes = torch_png::encode_to_memory(image, parallel);
+    EXPECT_TRUE(torch_png::decode_from_memory(parallel_bytes).eq(image).all().item<bool>());
+    // batch and reused output
+    torch_png::encode(fp / "depth16.png", image);
+    const auto batch = torch_png::decode_batch({fp / "depth16.png", fp / "depth16.png"});
+    EXPECT_TRUE(batch.select(0, 1).eq(image).all().item<bool>());
+    torch_png::Decoder decoder(options);
+    auto               out = torch::empty({3, 128, 171}, torch::TensorOptions().dtype(torch::kFloat));
+    decoder.decode_into(fp / "depth16.png", out);
+    EXPECT_LT(out.sub(normalized).abs().max().item<float>(), 1e-6);
+    // the output type must match
+    torch_png::Decoder default_decoder;
+    EXPECT_THROW(default_decoder.decode_into(fp / "depth16.png", out), std::invalid_argument);
+    // unsupported type
+    options.dtype = torch::kFloat64;
+    EXPECT_THROW(torch_png::decode_from_memory(bytes, options), std::invalid_argument);
+    EXPECT_THROW(torch_png::encode_to_memory(image.to(torch::kFloat64)), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeNormalized) {
+    const auto image = torch::arange(3 * 40 * 50, torch::TensorOptions().dtype(torch::kInt32))
+                           .mul(7)
+                           .remainder(256)
+                           .to(torch::kUInt8)
+                           .reshape({3, 40, 50});
+    const auto                bytes  = torch_png::encode_to_memory(image);
+    const std::vector<float> mean   = {0.485f, 0.456f, 0.406f};
+    const std::vector<float> stddev = {0.229f, 0.224f, 0.225f};
+    // what the consumers did after decoding: image.to(kFloat).div(255).sub(mean).div(std)
+    auto expected = image.to(torch::kFloat).div(255);
+    for (std::int64_t c = 0; c < 3; ++c)
+        expected.select(0, c).copy_(expected.select(0, c).sub(mean[c]).div(stddev[c]));
+
+    torch_png::DecodeOptions options;
+    options.dtype  = torch::kFloat;
+    options.mean   = mean;
+    options.stddev = stddev;
+    const auto normalized = torch_png::decode_from_memory(bytes, options);
+    EXPECT_EQ(normalized.scalar_type(), torch::kFloat);
+    EXPECT_LT(normalized.sub(expected).abs().max().item<float>(), 1e-5);
+    // interleaved
+    options.layout = torch_png::Layout::HWC;
+    EXPECT_LT(torch_png::decode_from_memory(bytes, options).sub(expected.permute({1, 2, 0})).abs().max().item<float>(),
+              1e-5);
+    // half precision outputs
+    options.layout = torch_png::Layout::CHW;
+    for (const auto dtype : {torch::kHalf, torch::kBFloat16}) {
+        options.dtype      = dtype;
+        const auto decoded = torch_png::decode_from_memory(bytes, options);
+        EXPECT_EQ(decoded.scalar_type(), dtype);
+        EXPECT_LT(decoded.to(torch::kFloat).sub(expected).abs().max().item<float>(), 2e-2);
+    }
+    // a single value applies to all the channels, scale 255 keeps the range of the samples
+    torch_png::DecodeOptions scaled;
+    scaled.dtype = torch::kFloat;
+    scaled.scale = {255.f};
+    scaled.mean  = {128.f};
+    EXPECT_LT(torch_png::decode_from_memory(bytes, scaled)
+                  .sub(image.to(torch::kFloat).sub(128))
+                  .abs()
+                  .max()
+                  .item<float>(),
+              1e-4);
+    // box downscale: the averages are normalized
+    options.dtype        = torch::kFloat;
+    options.scale_factor = 2;
+    const auto box       = torch_png::decode_from_memory(bytes, options);
+    ASSERT_EQ(box.size(1), 20);
+    const float average = (image[1][2][4].item<std::uint8_t>() + image[1][2][5].item<std::uint8_t>() +
+                           image[1][3][4].item<std::uint8_t>() + image[1][3][5].item<std::uint8_t>()) /
+                          4.f;
+    EXPECT_NEAR(box[1][1][2].item<float>(), (average / 255 - mean[1]) / stddev[1], 1e-5);
+    // half precision images encode to 16 bit pngs
+    const auto half_image = image.to(torch::kFloat).div(255).to(torch::kHalf);
+    torch_png::DecodeOptions float_options;
+    float_options.dtype = torch::kFloat;
+    EXPECT_LT(torch_png::decode_from_memory(torch_png::encode_to_memory(half_image), float_options)
+                  .sub(half_image.to(torch::kFloat))
+                  .abs()
+                  .max()
+                  .item<float>(),
+              1e-4);
+    // normalization only applies to floating point types
+    torch_png::DecodeOptions invalid;
+    invalid.mean = mean;
+    EXPECT_THROW(torch_png::decode_from_memory(bytes, invalid), std::invalid_argument);
+    invalid.dtype = torch::kUInt8;
+    EXPECT_THROW(torch_png::decode_from_memory(bytes, invalid), std::invalid_argument);
+    // one value per decoded channel
+    invalid.dtype = torch::kFloat;
+    invalid.mean  = {0.5f, 0.5f};
+    EXPECT_THROW(torch_png::decode_from_memory(bytes, invalid), std::invalid_argument);
+    invalid.mean   = {};
+    invalid.stddev = {0.f};
+    EXPECT_THROW(torch_png::decode_from_memory(bytes, invalid), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodePalette) {
+    const std::vector<png_color>    palette = {{0, 0, 0}, {255, 0, 0}, {0, 255, 0}, {0, 0, 255}, {10, 20, 30}};
+    const std::vector<std::uint8_t> alphas  = {0, 128};
+    // 4 bit indices, two per byte: a 2x5 image (odd width)
+    const std::vector<std::vector<std::uint8_t>> rows = {{0x01, 0x23, 0x40}, {0x43, 0x21, 0x00}};
+    const std::vector<std::vector<std::uint8_t>> indices = {{0, 1, 2, 3, 4}, {4, 3, 2, 1, 0}};
+
+    test_io::write_png(fp / "palette.png", 5, 4, PNG_COLOR_TYPE_PALETTE, rows, palette);
+    test_io::write_png(fp / "palette_trns.png", 5, 4, PNG_COLOR_TYPE_PALETTE, rows, palette, alphas);
+    // rgb and rgb alpha colors, CHW and HWC
+    const auto rgb  = torch_png::decode(fp / "palette.png");
+    const auto rgba = torch_png::decode(fp / "palette_trns.png");
+    ASSERT_EQ(rgb.size(0), 3);
+    ASSERT_EQ(rgba.size(0), 4);
+
+    torch_png::DecodeOptions hwc;
+    hwc.layout       = torch_png::Layout::HWC;
+    const auto rgb_hwc = torch_png::decode(fp / "palette.png", hwc);
+
+    for (std::int64_t y = 0; y < 2; ++y) {
+        for (std::int64_t x = 0; x < 5; ++x) {
+            const auto& color = palette[indices[y][x]];
+            EXPECT_EQ(rgb[0][y][x].item<std::uint8_t>(), color.red);
+            EXPECT_EQ(rgb[1][y][x].item<std::uint8_t>(), color.green);
+            EXPECT_EQ(rgb[2][y][x].item<std::uint8_t>(), color.blue);
+            EXPECT_EQ(rgb_hwc[y][x][2].item<std::uint8_t>(), color.blue);
+            // entries past the tRNS chunk are opaque
+            EXPECT_EQ(rgba[3][y][x].item<std::uint8_t>(), indices[y][x] < 2 ? alphas[indices[y][x]] : 255);
+        }
+    }
+    // raw indices as a single channel, in a batch
+    torch_png::DecodeOptions raw;
+    raw.palette_indices = true;
+    const auto labels   = torch_png::decode_batch({fp / "palette.png", fp / "palette_trns.png"}, {}, raw);
+    ASSERT_EQ(labels.size(1), 1);
+    for (std::int64_t y = 0; y < 2; ++y)
+        for (std::int64_t x = 0; x < 5; ++x)
+            EXPECT_EQ(labels[1][0][y][x].item<std::uint8_t>(), indices[y][x]);
+
+    raw.dtype = torch::kInt32;
+    EXPECT_EQ(torch_png::decode(fp / "palette.png", raw)[0][1][0].item<std::int32_t>(), 4);
+    raw.dtype = torch::kFloat;
+    EXPECT_THROW(torch_png::decode(fp / "palette.png", raw), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeSubByteGray) {
+    // 1 bit mask and 2 bit gray, 11 pixels wide
+    test_io::write_png(fp / "mask.png", 11, 1, PNG_COLOR_TYPE_GRAY, {{0xA5, 0xE0}});
+    test_io::write_png(fp / "gray2.png", 11, 2, PNG_COLOR_TYPE_GRAY, {{0x1B, 0xE4, 0x1B}});
+
+    const std::vector<int> mask = {1, 0, 1, 0, 0, 1, 0, 1, 1, 1, 1};
+    const std::vector<int> gray = {0, 1, 2, 3, 3, 2, 1, 0, 0, 1, 2};
+
+    const auto mask_image = torch_png::decode(fp / "mask.png");
+    const auto gray_image = torch_png::decode(fp / "gray2.png");
+    ASSERT_EQ(mask_image.size(0), 1);
+    ASSERT_EQ(mask_image.scalar_type(), torch::kUInt8);
+
+    torch_png::DecodeOptions normalized;
+    normalized.dtype      = torch::kFloat;
+    const auto gray_float = torch_png::decode(fp / "gray2.png", normalized);
+
+    for (std::int64_t x = 0; x < 11; ++x) {
+        // samples are scaled to [0, 255]
+        EXPECT_EQ(mask_image[0][0][x].item<std::uint8_t>(), mask[x] * 255);
+        EXPECT_EQ(gray_image[0][0][x].item<std::uint8_t>(), gray[x] * 85);
+        EXPECT_FLOAT_EQ(gray_float[0][0][x].item<float>(), gray[x] / 3.f);
+    }
+}
+
+TEST_F(PngErrorsTest, testDecodeRoi) {
+    const auto image = torch::arange(3 * 100 * 100, torch::TensorOptions().dtype(torch::kInt32))
+                           .to(torch::kUInt8)
+                           .reshape({3, 100, 100});
+    torch_png::encode(fp / "roi.png", image);
+    // crop, top rows, full image
+    EXPECT_TRUE(torch_png::decode_roi(fp / "roi.png", 10, 20, 30, 40)
+                    .eq(image.narrow(1, 10, 30).narrow(2, 20, 40))
+                    .all()
+                    .item<bool>());
+    EXPECT_TRUE(torch_png::decode_roi(fp / "roi.png", 0, 0, 5, 100).eq(image.narrow(1, 0, 5)).all().item<bool>());
+    EXPECT_TRUE(torch_png::decode_roi(fp / "roi.png", 0, 0, 100, 100).eq(image).all().item<bool>());
+    // interleaved layout, 16 bit converted samples and expanded palettes share the row loop
+    torch_png::DecodeOptions hwc;
+    hwc.layout     = torch_png::Layout::HWC;
+    const auto crop = torch_png::decode_roi(fp / "roi.png", 99, 1, 1, 98, hwc);
+    EXPECT_TRUE(crop.permute({2, 0, 1}).eq(image.narrow(1, 99, 1).narrow(2, 1, 98)).all().item<bool>());
+
+    torch_png::encode(fp / "roi16.png", image.to(torch::kInt32).mul(257));
+    torch_png::DecodeOptions to_uint8;
+    to_uint8.dtype = torch::kUInt8;
+    EXPECT_TRUE(torch_png::decode_roi(fp / "roi16.png", 50, 50, 7, 9, to_uint8)
+                    .eq(image.narrow(1, 50, 7).narrow(2, 50, 9))
+                    .all()
+                    .item<bool>());
+
+    test_io::write_png(fp / "roi_palette.png", 5, 4, PNG_COLOR_TYPE_PALETTE, {{0x01, 0x23, 0x40}, {0x43, 0x21, 0x00}},
+                       {{0, 0, 0}, {1, 1, 1}, {2, 2, 2}, {3, 3, 3}, {4, 4, 4}});
+    const auto palette_crop = torch_png::decode_roi(fp / "roi_palette.png", 1, 1, 1, 3);
+    EXPECT_EQ(palette_crop[0][0][0].item<std::uint8_t>(), 3);
+    EXPECT_EQ(palette_crop[2][0][2].item<std::uint8_t>(), 1);
+    // the rows below the region are never read: a truncated file still decodes its top rows
+    torch_png::EncodeOptions stored;
+    stored.compression_level = 0;
+    torch_png::encode(fp / "roi_stored.png", image, stored);
+    auto bytes = test_io::read_bytes(fp / "roi_stored.png");
+    bytes.resize(bytes.size() / 2);
+    std::ofstream(fp / "roi_truncated.png", std::ios::binary)
+        .write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    EXPECT_TRUE(torch_png::decode_roi(fp / "roi_truncated.png", 0, 0, 10, 100)
+                    .eq(image.narrow(1, 0, 10))
+                    .all()
+                    .item<bool>());
+    EXPECT_THROW(torch_png::decode(fp / "roi_truncated.png"), torch_png::DecodeError);
+    // out of the image
+    EXPECT_THROW(torch_png::decode_roi(fp / "roi.png", 90, 0, 11, 10), std::invalid_argument);
+    EXPECT_THROW(torch_png::decode_roi(fp / "roi.png", 0, -1, 10, 10), std::invalid_argument);
+    EXPECT_THROW(torch_png::decode_roi(fp / "roi.png", 0, 0, 10, 0), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeDownscaled) {
+    // 7x10 blocks of 2 leave partial blocks on both edges
+    const auto image = torch::arange(3 * 7 * 10, torch::TensorOptions().dtype(torch::kInt32))
+                           .mul(5)
+                           .remainder(256)
+                           .to(torch::kUInt8)
+                           .reshape({3, 7, 10});
+    torch_png::encode(fp / "downscale.png", image);
+
+    torch_png::DecodeOptions box;
+    box.scale_factor = 2;
+    const auto box_image = torch_png::decode(fp / "downscale.png", box);
+    box.dtype            = torch::kFloat;
+    const auto box_float = torch_png::decode(fp / "downscale.png", box);
+    ASSERT_EQ(box_image.size(1), 4);
+    ASSERT_EQ(box_image.size(2), 5);
+
+    for (std::int64_t c = 0; c < 3; ++c) {
+        for (std::int64_t y = 0; y < 4; ++y) {
+            for (std::int64_t x = 0; x < 5; ++x) {
+                // average of the (partial) block
+                std::int64_t sum = 0, count = 0;
+                for (std::int64_t yy = 2 * y; yy < std::min<std::int64_t>(2 * y + 2, 7); ++yy)
+                    for (std::int64_t xx = 2 * x; xx < 2 * x + 2; ++xx, ++count)
+                        sum += image[c][yy][xx].item<std::uint8_t>();
+                EXPECT_EQ(box_image[c][y][x].item<std::uint8_t>(), (sum + count / 2) / count);
+                EXPECT_FLOAT_EQ(box_float[c][y][x].item<float>(), static_cast<float>(sum) / (count * 255));
+            }
+        }
+    }
+    // subsampled, interleaved
+    torch_png::DecodeOptions subsample;
+    subsample.scale_factor = 4;
+    subsample.downscale    = torch_png::Downscale::Subsample;
+    subsample.layout       = torch_png::Layout::HWC;
+    EXPECT_TRUE(torch_png::decode(fp / "downscale.png", subsample)
+                    .permute({2, 0, 1})
+                    .eq(image.slice(1, 0, 7, 4).slice(2, 0, 10, 4))
+                    .all()
+                    .item<bool>());
+    // batch of downscaled images
+    const auto batch = torch_png::decode_batch({fp / "downscale.png", fp / "downscale.png"}, {}, box);
+    EXPECT_TRUE(batch.select(0, 1).eq(box_float).all().item<bool>());
+
+    box.scale_factor = 3;
+    EXPECT_THROW(torch_png::decode(fp / "downscale.png", box), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testDecodeDownscaledAdam7) {
+    const auto image = torch::arange(37 * 45 * 3, torch::TensorOptions().dtype(torch::kInt32))
+                           .remainder(251)
+                           .to(torch::kUInt8)
+                           .reshape({37, 45, 3});
+    test_io::write_png(fp / "adam7.png", 45, 8, PNG_COLOR_TYPE_RGB, test_io::to_rows(image), {}, {},
+                       PNG_INTERLACE_ADAM7);
+    // the first passes hold the subsampled pixels
+    for (const int factor : {2, 4, 8}) {
+        torch_png::DecodeOptions options;
+        options.scale_factor = factor;
+        options.downscale    = torch_png::Downscale::Subsample;
+        const auto expected  = image.slice(0, 0, 37, factor).slice(1, 0, 45, factor).permute({2, 0, 1});
+        EXPECT_TRUE(torch_png::decode(fp / "adam7.png", options).eq(expected).all().item<bool>()) << factor;
+        // aligned regions
+        EXPECT_TRUE(torch_png::decode_roi(fp / "adam7.png", 8, 16, 21, 27, options)
+                        .eq(image.slice(0, 8, 29, factor).slice(1, 16, 43, factor).permute({2, 0, 1}))
+                        .all()
+                        .item<bool>())
+            << factor;
+    }
+    // box filter of the interlaced png, as of the non interlaced one
+    test_io::write_png(fp / "progressive.png", 45, 8, PNG_COLOR_TYPE_RGB, test_io::to_rows(image));
+    for (const int factor : {2, 4, 8}) {
+        torch_png::DecodeOptions options;
+        options.scale_factor = factor;
+        EXPECT_TRUE(torch_png::decode(fp / "adam7.png", options)
+                        .eq(torch_png::decode(fp / "progressive.png", options))
+                        .all()
+                        .item<bool>())
+            << factor;
+        // unaligned subsampled regions read all the passes
+        options.downscale = torch_png::Downscale::Subsample;
+        EXPECT_TRUE(torch_png::decode_roi(fp / "adam7.png", 3, 5, 30, 37, options)
+                        .eq(torch_png::decode_roi(fp / "progressive.png", 3, 5, 30, 37, options))
+                        .all()
+                        .item<bool>())
+            << factor;
+    }
+}
+
+TEST_F(PngErrorsTest, testDecodeAdam7) {
+    const auto image = torch::arange(37 * 45 * 3, torch::TensorOptions().dtype(torch::kInt32))
+                           .remainder(251)
+                           .to(torch::kUInt8)
+                           .reshape({37, 45, 3});
+    test_io::write_png(fp / "adam7.png", 45, 8, PNG_COLOR_TYPE_RGB, test_io::to_rows(image), {}, {},
+                       PNG_INTERLACE_ADAM7);
+    // full decodes, planar and interleaved
+    EXPECT_TRUE(torch_png::decode(fp / "adam7.png").eq(image.permute({2, 0, 1})).all().item<bool>());
+    torch_png::DecodeOptions hwc;
+    hwc.layout = torch_png::Layout::HWC;
+    EXPECT_TRUE(torch_png::decode(fp / "adam7.png", hwc).eq(image).all().item<bool>());
+    EXPECT_TRUE(torch_png::decode_roi(fp / "adam7.png", 3, 5, 30, 37, hwc)
+                    .eq(image.slice(0, 3, 33).slice(1, 5, 42))
+                    .all()
+                    .item<bool>());
+    std::vector<std::uint8_t> bytes(fs::file_size(fp / "adam7.png"));
+    FILE*                     file = fopen((fp / "adam7.png").c_str(), "rb");
+    ASSERT_EQ(fread(bytes.data(), 1, bytes.size(), file), bytes.size());
+    fclose(file);
+    EXPECT_TRUE(torch_png::decode_from_memory(bytes.data(), bytes.size(), hwc).eq(image).all().item<bool>());
+
+    // progressive display: the pixels of the first passes are replicated over their blocks
+    const int block_widths[]  = {8, 4, 4, 2, 2, 1, 1};
+    const int block_heights[] = {8, 8, 4, 4, 2, 2, 1};
+    for (int passes = 1; passes <= 7; ++passes) {
+        const auto expected = image.clone();
+        const auto pixels   = image.data_ptr<std::uint8_t>();
+        for (std::int64_t y = 0; y < 37; ++y)
+            for (std::int64_t x = 0; x < 45; ++x) {
+                const auto yb = y / block_heights[passes - 1] * block_heights[passes - 1];
+                const auto xb = x / block_widths[passes - 1] * block_widths[passes - 1];
+                std::copy_n(pixels + (yb * 45 + xb) * 3, 3, expected.data_ptr<std::uint8_t>() + (y * 45 + x) * 3);
+            }
+
+        hwc.adam7_passes = passes;
+        EXPECT_TRUE(torch_png::decode(fp / "adam7.png", hwc).eq(expected).all().item<bool>()) << passes;
+        EXPECT_TRUE(torch_png::decode_roi(fp / "adam7.png", 3, 5, 30, 37, hwc)
+                        .eq(expected.slice(0, 3, 33).slice(1, 5, 42))
+                        .all()
+                        .item<bool>())
+            << passes;
+        // downscaled previews of the replicated pixels
+        torch_png::DecodeOptions box;
+        box.adam7_passes = passes;
+        box.scale_factor = 2;
+        test_io::write_png(fp / "expected.png", 45, 8, PNG_COLOR_TYPE_RGB, test_io::to_rows(expected));
+        EXPECT_TRUE(torch_png::decode(fp / "adam7.png", box)
+                        .eq(torch_png::decode(fp / "expected.png", box))
+                        .all()
+                        .item<bool>())
+            << passes;
+        box.downscale = torch_png::Downscale::Subsample;
+        EXPECT_TRUE(torch_png::decode_roi(fp / "adam7.png", 3, 5, 30, 37, box)
+                        .eq(torch_png::decode_roi(fp / "expected.png", 3, 5, 30, 37, box))
+                        .all()
+                        .item<bool>())
+            << passes;
+    }
+    // 16 bit and palette interlaced pngs
+    const auto deep = torch::arange(13 * 11, torch::TensorOptions().dtype(torch::kInt32)).mul(397).reshape({13, 11});
+    std::vector<std::vector<std::uint8_t>> deep_rows(13, std::vector<std::uint8_t>(22));
+    for (std::int64_t y = 0; y < 13; ++y)
+        for (std::int64_t x = 0; x < 11; ++x) {
+            deep_rows[y][2 * x]     = static_cast<std::uint8_t>(deep[y][x].item<int>() >> 8);
+            deep_rows[y][2 * x + 1] = static_cast<std::uint8_t>(deep[y][x].item<int>() & 0xff);
+        }
+    test_io::write_png(fp / "adam7_16.png", 11, 16, PNG_COLOR_TYPE_GRAY, deep_rows, {}, {}, PNG_INTERLACE_ADAM7);
+    EXPECT_TRUE(torch_png::decode(fp / "adam7_16.png").to(torch::kInt32).eq(deep.unsqueeze(0)).all().item<bool>());
+
+    const std::vector<png_color>           palette = {{0, 0, 0}, {255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+    std::vector<std::vector<std::uint8_t>> indices(9, std::vector<std::uint8_t>(3));
+    for (std::size_t y = 0; y < indices.size(); ++y)
+        for (std::size_t x = 0; x < 12; ++x)
+            indices[y][x / 4] |= static_cast<std::uint8_t>(((x + y) % 4) << (6 - 2 * (x % 4)));
+    test_io::write_png(fp / "adam7_palette.png", 12, 2, PNG_COLOR_TYPE_PALETTE, indices, palette, {},
+                       PNG_INTERLACE_ADAM7);
+    torch_png::DecodeOptions raw;
+    raw.palette_indices = true;
+    const auto labels   = torch_png::decode(fp / "adam7_palette.png", raw);
+    for (std::int64_t y = 0; y < 9; ++y)
+        for (std::int64_t x = 0; x < 12; ++x)
+            EXPECT_EQ(labels[0][y][x].item<std::uint8_t>(), (x + y) % 4);
+
+    torch_png::DecodeOptions invalid;
+    for (const int passes : {0, 8}) {
+        invalid.adam7_passes = passes;
+        EXPECT_THROW(torch_png::decode(fp / "adam7.png", invalid), std::invalid_argument) << passes;
+    }
+}
+
+TEST_F(PngErrorsTest, testEncodeAdam7) {
+    const auto tensor = torch::arange(3 * 37 * 45, torch::TensorOptions().dtype(torch::kInt32))
+                            .remainder(251)
+                            .to(torch::kUInt8)
+                            .reshape({3, 37, 45});
+    torch_png::EncodeOptions options;
+    options.interlace = true;
+    // the parallel encoder is bypassed
+    for (const int threads : {1, 4}) {
+        options.threads   = threads;
+        const auto buffer = torch_png::encode_to_memory(tensor, options);
+        // IHDR interlace method
+        ASSERT_GT(buffer.numel(), 28);
+        EXPECT_EQ(buffer[28].item<std::uint8_t>(), 1) << threads;
+        EXPECT_TRUE(torch_png::decode_from_memory(buffer).eq(tensor).all().item<bool>()) << threads;
+
+        torch_png::encode(fp / "interlaced.png", tensor, options);
+        EXPECT_TRUE(torch_png::decode(fp / "interlaced.png").eq(tensor).all().item<bool>()) << threads;
+    }
+    // 16 bit
+    const auto deep = tensor.to(torch::kInt32).mul(257);
+    torch_png::encode(fp / "interlaced_16.png", deep, options);
+    EXPECT_TRUE(torch_png::decode(fp / "interlaced_16.png").eq(deep).all().item<bool>());
+    // the first pass of the encoded png
+    torch_png::DecodeOptions preview;
+    preview.scale_factor = 8;
+    preview.downscale    = torch_png::Downscale::Subsample;
+    EXPECT_TRUE(torch_png::decode(fp / "interlaced.png", preview)
+                    .eq(tensor.slice(1, 0, 37, 8).slice(2, 0, 45, 8))
+                    .all()
+                    .item<bool>());
+
+    EXPECT_THROW(torch_png::StreamEncoder(fp / "interlaced.png", 37, 45, 3, options), std::invalid_argument);
+}
+
+TEST_F(PngErrorsTest, testShard) {
+    const auto options = torch::TensorOptions().dtype(torch::kUInt8);
+    // five {channels=3, rows=32, columns=24} images, a smaller one and a 16 bit gray one
+    const auto batch = torch::arange(5 * 3 * 32 * 24, options.dtype(torch::kInt32))
+                           .to(torch::kUInt8)
+                           .reshape({5, 3, 32, 24});
+    const auto small   = torch::arange(3 * 8 * 6, options).reshape({3, 8, 6});
+    const auto gray16  = torch::arange(40 * 30, options.dtype(torch::kInt32)).mul(50).reshape({1, 40, 30});
+    const auto encoded = torch_png::encode_to_memory(gray16);
+    // in memory batches
+    const auto pngs = torch_png::encode_batch_to_memory(batch, torch_png::EncodeOptions(), 2);
+    ASSERT_EQ(pngs.size(), 5u);
+    std::vector<torch_png::PngBuffer> buffers;
+    for (const auto& png : pngs)
+        buffers.push_back({png.data_ptr<std::uint8_t>(), static_cast<std::size_t>(png.numel()), ""});
+    EXPECT_TRUE(torch_png::decode_batch_from_memory(buffers).eq(batch).all().item<bool>());
+    buffers[3].size   = 20;
+    buffers[3].source = "item 3";
+    try {
+        torch_png::decode_batch_from_memory(buffers);
+        FAIL() << "Expected torch_png::DecodeError";
+    } catch (const torch_png::DecodeError& error) {
+        EXPECT_EQ(error.source(), "item 3");
+    }
+
+    {
+        torch_png::ShardWriter writer(fp / "shard.tpng");
+        EXPECT_EQ(writer.add_batch(batch, 2), 0u);
+        EXPECT_EQ(writer.add(small), 5u);
+        EXPECT_EQ(writer.add_encoded(encoded.data_ptr<std::uint8_t>(), encoded.numel()), 6u);
+        EXPECT_THROW(writer.add_encoded(encoded.data_ptr<std::uint8_t>(), 10), torch_png::DecodeError);
+        // the IHDR fields are checked
+        std::vector<std::uint8_t> invalid(encoded.data_ptr<std::uint8_t>(),
+                                          encoded.data_ptr<std::uint8_t>() + encoded.numel());
+        invalid[24] = 3;
+        try {
+            writer.add_encoded(invalid.data(), invalid.size());
+            FAIL() << "Expected torch_png::DecodeError";
+        } catch (const torch_png::DecodeError& error) {
+            EXPECT_EQ(error.source(), (fp / "shard.tpng").string() + "[7]");
+            EXPECT_EQ(error.reason(), "Invalid color type and bit depth in IHDR.");
+        }
+        EXPECT_EQ(writer.size(), 7u);
+        writer.close();
+        writer.close();
+        EXPECT_THROW(writer.add(small), std::invalid_argument);
+    }
+    // random access
+    const torch_png::ShardReader reader(fp / "shard.tpng");
+    ASSERT_EQ(reader.size(), 7u);
+    EXPECT_EQ(reader.item(0).height, 32);
+    EXPECT_EQ(reader.item(0).width, 24);
+    EXPECT_EQ(reader.item(0).channels, 3);
+    EXPECT_EQ(reader.item(6).bit_depth, 16);
+    EXPECT_EQ(reader.item(6).color_type, PNG_COLOR_TYPE_GRAY);
+    EXPECT_EQ(reader.item(6).size, static_cast<std::uint64_t>(encoded.numel()));
+    EXPECT_TRUE(reader.decode(5).eq(small).all().item<bool>());
+    EXPECT_TRUE(reader.decode(6).eq(gray16).all().item<bool>());
+
+    const auto shuffled = reader.decode_batch({4, 0, 4});
+    EXPECT_TRUE(shuffled.select(0, 0).eq(batch.select(0, 4)).all().item<bool>());
+    EXPECT_TRUE(shuffled.select(0, 1).eq(batch.select(0, 0)).all().item<bool>());
+    EXPECT_TRUE(shuffled.select(0, 2).eq(batch.select(0, 4)).all().item<bool>());
+    EXPECT_THROW(reader.decode_batch({0, 5}), std::invalid_argument);
+    const auto padded = reader.decode_batch({5, 1}, torch_png::BatchPolicy::Pad);
+    EXPECT_TRUE(padded.select(0, 0).narrow(1, 0, 8).narrow(2, 0, 6).eq(small).all().item<bool>());
+    EXPECT_THROW(reader.item(7), std::invalid_argument);
+    EXPECT_THROW(reader.decode(7), std::invalid_argument);
+    // sequential scan
+    const torch_png::ShardReader scan(fp / "shard.tpng", torch_png::ShardAccess::Sequential);
+    for (std::size_t first = 0; first < 4; first += 2) {
+        const auto range = scan.decode_range(first, 2);
+        EXPECT_TRUE(range.eq(batch.narrow(0, first, 2)).all().item<bool>());
+    }
+    EXPECT_THROW(scan.decode_range(5, 3), std::invalid_argument);
+
+    // a png is not a shard, and its mapping doesn't outlive the error
+    torch_png::encode(fp / "not_a_shard.png", small);
+    const auto mappings = [this]() {
+        std::ifstream maps("/proc/self/maps");
+        std::string   line;
+        std::size_t   count = 0;
+        while (std::getline(maps, line))
+            count += line.find((fp / "not_a_shard.png").string()) != std::string::npos;
+        return count;
+    };
+    for (int i = 0; i < 5; ++i)
+        EXPECT_THROW(torch_png::ShardReader(fp / "not_a_shard.png"), torch_png::DecodeError);
+    EXPECT_EQ(mappings(), 0u);
+    EXPECT_THROW(torch_png::ShardReader(fp / "missing.tpng"), torch_png::DecodeError);
+    fs::remove(fp / "not_a_shard.png");
+    // truncated shard, then a corrupted png: its errors name the shard and the index
+    auto bytes = test_io::read_bytes(fp / "shard.tpng");
+    std::ofstream(fp / "truncated.tpng", std::ios::binary).write(reinterpret_cast<const char*>(bytes.data()), 100);
+    EXPECT_THROW(torch_png::ShardReader(fp / "truncated.tpng"), torch_png::DecodeError);
+    fs::remove(fp / "truncated.tpng");
+
+    bytes[reader.item(2).offset + 40] ^= 0xff;
+    std::ofstream(fp / "corrupted.tpng", std::ios::binary)
+        .write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    {
+        const torch_png::ShardReader corrupted(fp / "corrupted.tpng");
+        EXPECT_TRUE(corrupted.decode(1).eq(batch.select(0, 1)).all().item<bool>());
+        try {
+            corrupted.decode_range(0, 4);
+            FAIL() << "Expected torch_png::DecodeError";
+        } catch (const torch_png::DecodeError& error) {
+            EXPECT_EQ(error.source(), (fp / "corrupted.tpng").string() + "[2]");
+        }
+    }
+    fs::remove(fp / "corrupted.tpng");
+    fs::remove(fp / "shard.tpng");
+    // an unclosed shard is removed
+    {
+        torch_png::ShardWriter writer(fp / "unfinished.tpng");
+        writer.add(small);
+        EXPECT_TRUE(fs::exists(fp / "unfinished.tpng"));
+    }
+    EXPECT_FALSE(fs::exists(fp / "unfinished.tpng"));
+}
+
+TEST_F(PngErrorsTest, testPrefetcher) {
+    std::vector<fs::path>      filepaths;
+    std::vector<torch::Tensor> images;
+    for (std::int64_t i = 0; i < 12; ++i) {
+        images.push_back(torch::arange(i, i + 3 * 8 * 9, torch::TensorOptions().dtype(torch::kInt32))
+                             .to(torch::kUInt8)
+                             .reshape({3, 8, 9}));
+        filepaths.push_back(fp / ("prefetch_" + std::to_string(i) + ".png"));
+        torch_png::encode(filepaths.back(), images.back());
+    }
+    // in order whatever the decoding order, with a queue smaller than the stream
+    torch_png::PrefetchOptions options;
+    options.workers  = 3;
+    options.capacity = 4;
+    {
+        torch_png::Prefetcher prefetcher(filepaths, options);
+        for (std::size_t i = 0; i < images.size(); ++i) {
+            const auto image = prefetcher.next();
+            ASSERT_TRUE(image.has_value());
+            EXPECT_TRUE(image->eq(images[i]).all().item<bool>()) << i;
+            EXPECT_LE(prefetcher.stats().queue_depth + prefetcher.stats().in_flight, options.capacity);
+        }
+        EXPECT_FALSE(prefetcher.next().has_value());
+        EXPECT_EQ(prefetcher.stats().consumed, images.size());
+    }
+    // a failing item is rethrown in its turn and the stream goes on
+    auto with_error = filepaths;
+    with_error[5]   = fp / "prefetch_missing.png";
+    {
+        torch_png::Prefetcher prefetcher(with_error, options);
+        for (std::size_t i = 0; i < images.size(); ++i) {
+            if (i == 5) {
+                EXPECT_THROW(prefetcher.next(), torch_png::DecodeError);
+                continue;
+            }
+            EXPECT_TRUE(prefetcher.next()->eq(images[i]).all().item<bool>()) << i;
+        }
+        EXPECT_FALSE(prefetcher.next().has_value());
+    }
+    // batches from a generator, the last batch is smaller
+    options.batch_size = 5;
+    std::size_t next   = 0;
+    {
+        torch_png::Prefetcher prefetcher(
+            [&]() -> std::optional<fs::path> {
+                if (next == filepaths.size())
+                    return std::nullopt;
+                return filepaths[next++];
+            },
+            options);
+        for (std::int64_t b = 0; b < 3; ++b) {
+            const auto batch = prefetcher.next();
+            ASSERT_TRUE(batch.has_value());
+            ASSERT_EQ(batch->size(0), b < 2 ? 5 : 2);
+            for (std::int64_t i = 0; i < batch->size(0); ++i)
+                EXPECT_TRUE(batch->select(0, i).eq(images[b * 5 + i]).all().item<bool>());
+        }
+        EXPECT_FALSE(prefetcher.next().has_value());
+    }
+    // destroyed before the end of the stream
+    {
+        torch_png::Prefetcher prefetcher(filepaths, options);
+        EXPECT_TRUE(prefetcher.next().has_value());
+    }
+    options.workers = -1;
+    EXPECT_THROW(torch_png::Prefetcher(filepaths, options), std::invalid_argument);
+
+    for (const auto& filepath : filepaths)
+        fs::remove(filepath);
+}
+
+TEST_F(PngErrorsTest, testDecoderEncoder) {
+    torch_png::Encoder encoder;
+    torch_png::Decoder decoder;
+    // preallocated output, reused across images of the same dims
+    auto out = torch::empty({3, 6, 9}, torch::TensorOptions().dtype(torch::kUInt8));
+
+    for (std::int64_t i = 0; i < 4; ++i) {
+        const auto image = torch::arange(i, i + 3 * 6 * 9, torch::TensorOptions().dtype(torch::kInt32))
+                               .to(torch::kUInt8)
+                               .reshape({3, 6, 9});
+        // file round trip
+        encoder.encode(fp / "codec.png", image);
+        EXPECT_TRUE(decoder.decode(fp / "codec.png").eq(image).all().item<bool>());
+        // buffer round trip in the preallocated output
+        const auto& bytes = encoder.encode_to_buffer(image);
+        decoder.decode_into(bytes.data(), bytes.size(), out);
+        EXPECT_TRUE(out.eq(image).all().item<bool>());
+    }
+    // output dims must match the image
+    auto bad_out = torch::empty({3, 9, 6}, torch::TensorOptions().dtype(torch::kUInt8));
+    EXPECT_THROW(decoder.decode_into(fp / "codec.png", bad_out), std::invalid_argument);
+    // and the decoder is still usable after an error
+    decoder.decode_into(fp / "codec.png", out);
+    fs::remove(fp / "codec.png");
+}
+
+TEST_F(PngErrorsTest, testDecodeErrors) {
+    // missing file
+    EXPECT_THROW(torch_png::decode(fp / "missing.png"), torch_png::DecodeError);
+    EXPECT_THROW(torch_png::getDims(fp / "missing.png"), torch_png::DecodeError);
+    // not a png
+    const std::uint8_t not_png[16] = {0};
+    EXPECT_THROW(torch_png::decode_from_memory(not_png, sizeof(not_png)), torch_png::DecodeError);
+    // truncated png
+    const auto image = torch::arange(3 * 16 * 16, torch::TensorOptions().dtype(torch::kUInt8)).reshape({3, 16, 16});
+    const auto bytes = torch_png::encode_to_memory(image);
+    try {
+        torch_png::decode_from_memory(bytes.data_ptr<std::uint8_t>(), bytes.numel() / 2);
+        FAIL() << "Expected torch_png::DecodeError";
+    } catch (const torch_png::DecodeError& error) {
+        EXPECT_EQ(error.source(), "<memory>");
+        EXPECT_FALSE(error.reason().empty());
+    }
+    // a bad file in a batch is reported without crashing the other decoders
+    const std::vector<std::uint8_t> truncated(bytes.data_ptr<std::uint8_t>(),
+                                              bytes.data_ptr<std::uint8_t>() + bytes.numel() / 2);
+    std::ofstream(fp / "truncated.png", std::ios::binary)
+        .write(reinterpret_cast<const char*>(truncated.data()), truncated.size());
+    torch_png::encode(fp / "valid.png", image);
+    EXPECT_THROW(torch_png::decode_batch({fp / "valid.png", fp / "truncated.png", fp / "valid.png"}),
+                 torch_png::DecodeError);
+    fs::remove(fp / "truncated.png");
+    fs::remove(fp / "valid.png");
+    // unwritable file
+    EXPECT_THROW(torch_png::encode(fp / "missing_dir" / "image.png", image), torch_png::EncodeError);
+    // empty images never reach libpng
+    for (const auto& empty : {torch::zeros({1, 3, 0}, torch::kUInt8), torch::zeros({1, 0, 3}, torch::kUInt8)}) {
+        EXPECT_THROW(torch_png::encode(fp / "empty.png", empty), std::invalid_argument);
+        EXPECT_THROW(torch_png::encode_to_memory(empty), std::invalid_argument);
+    }
+}
+
+TEST_F(PngErrorsTest, testProbe) {
+    const auto rgba16 = torch::arange(4 * 7 * 9, torch::kInt32).view({4, 7, 9});
+    torch_png::encode(fp / "probe_rgba16.png", rgba16);
+    torch_png::encode(fp / "probe_gray.png", torch::zeros({1, 3, 5}, torch::kUInt8));
+    test_io::write_png(
+        fp / "probe_palette.png", 5, 4, PNG_COLOR_TYPE_PALETTE, {{0x01, 0x23, 0x40}}, std::vector<png_color>(5));
+    // IHDR with a bad CRC: only the validation notices it
+    auto bytes = test_io::read_bytes(fp / "probe_gray.png");
+    bytes[29] ^= 0xff;
+    std::ofstream(fp / "probe_crc.png", std::ios::binary)
+        .write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+
+    const std::vector<fs::path> paths = {fp / "probe_rgba16.png",
+                                         fp / "probe_gray.png",
+                                         fp / "probe_palette.png",
+                                         fp / "probe_missing.png",
+                                         fp / "probe_crc.png"};
+    const auto probe = torch_png::probe_many(paths);
+    ASSERT_EQ(probe.height.size(), paths.size());
+    ASSERT_EQ(probe.errors.size(), paths.size());
+    EXPECT_EQ(probe.height, std::vector<std::int32_t>({7, 3, 1, 0, 3}));
+    EXPECT_EQ(probe.width, std::vector<std::int32_t>({9, 5, 5, 0, 5}));
+    EXPECT_EQ(probe.channels, std::vector<std::uint8_t>({4, 1, 1, 0, 1}));
+    EXPECT_EQ(probe.bit_depth, std::vector<std::uint8_t>({16, 8, 4, 0, 8}));
+    EXPECT_EQ(probe.color_type,
+              std::vector<std::uint8_t>({PNG_COLOR_TYPE_RGB_ALPHA, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_PALETTE, 0,
+                                         PNG_COLOR_TYPE_GRAY}));
+    for (std::size_t i = 0; i < paths.size(); ++i)
+        EXPECT_EQ(probe.errors[i] != nullptr, i == 3);
+    // same infos as libpng
+    const auto validated = torch_png::probe_many(paths, true, 2);
+    EXPECT_EQ(validated.height, std::vector<std::int32_t>({7, 3, 1, 0, 0}));
+    EXPECT_EQ(validated.channels, std::vector<std::uint8_t>({4, 1, 1, 0, 0}));
+    EXPECT_EQ(validated.bit_depth, std::vector<std::uint8_t>({16, 8, 4, 0, 0}));
+    EXPECT_TRUE(validated.errors[3] && validated.errors[4]);
+    EXPECT_EQ(torch_png::getDims(paths[2]), torch_png::getDims(paths[2], true));
+    EXPECT_THROW(torch_png::getDims(paths[4], true), torch_png::DecodeError);
+    // buffers
+    EXPECT_EQ(torch_png::getDims_from_memory(bytes.data(), bytes.size()), torch_png::getDims(paths[4]));
+    EXPECT_THROW(torch_png::getDims_from_memory(bytes.data(), bytes.size(), true), torch_png::DecodeError);
+    EXPECT_THROW(torch_png::getDims_from_memory(bytes.data(), 20), torch_png::DecodeError);
+    // not a png
+    std::ofstream(fp / "probe_text.png") << "not a png file, long enough to hold an IHDR chunk";
+    EXPECT_THROW(torch_png::getDims(fp / "probe_text.png"), torch_png::DecodeError);
+    EXPECT_THROW(torch_png::probe_many(paths, false, -1), std::invalid_argument);
+
+    for (const auto& path : paths)
+        fs::remove(path);
+    fs::remove(fp / "probe_text.png");
+}
+
+TEST_F(PngErrorsTest, testStats) {
+    const auto image = torch::arange(3 * 64 * 48, torch::kInt32).remainder(256).to(torch::kUInt8).view({3, 64, 48});
+
+    torch_png::reset_stats();
+    torch_png::encode(fp / "stats.png", image);
+    torch_png::decode(fp / "stats.png");
+    torch_png::getDims(fp / "stats.png");
+    torch_png::EncodeOptions parallel;
+    parallel.threads = 2;
+    torch_png::encode_to_memory(image, parallel);
+    const auto stats = torch_png::stats();
+    fs::remove(fp / "stats.png");
+
+    if (!torch_png::stats_enabled()) {
+        EXPECT_EQ(stats.inflate.calls, 0u);
+        EXPECT_EQ(stats.io.calls, 0u);
+        return;
+    }
+    // one section per row
+    EXPECT_EQ(stats.inflate.calls, 64u);
+    EXPECT_EQ(stats.inflate.bytes, 64u * 48 * 3);
+    EXPECT_GT(stats.inflate.seconds, 0);
+    // decode, and the CHW rows of both encoders
+    EXPECT_EQ(stats.convert.calls, 3u * 64);
+    EXPECT_EQ(stats.filter.calls, 64u);
+    EXPECT_GE(stats.deflate.calls, 64u);
+    // libpng rows, and the filtered rows (with their filter byte) of the multithreaded encoder
+    EXPECT_EQ(stats.deflate.bytes, 64u * 48 * 3 + 64u * (48 * 3 + 1));
+    // decode, encode and getDims
+    EXPECT_EQ(stats.header.calls, 3u);
+    EXPECT_GT(stats.io.calls, 0u);
+    EXPECT_GT(stats.io.bytes, 0u);
+
+    torch_png::reset_stats();
+    EXPECT_EQ(torch_png::stats().inflate.calls, 0u);
+}
+
+TEST_F(PngErrorsTest, testBackend) {
+    const auto backend = torch_png::backend();
+    // libpng and zlib are part of every backend (encoding, interlaced decoding)
+    ASSERT_NE(backend.find("libpng "), std::string::npos);
+    ASSERT_NE(backend.find("zlib "), std::string::npos);
+}
+
 TEST_F(PngErrorsTest, testExceptions) {
-    // bad/good type
-    const auto bad_tensor_type  = torch_create::make_tensor_values<float>({3, 2, 1}, {1, 1, 3});
+    // bad/good type (float encodes to 16 bit pngs)
+    const auto bad_tensor_type  = torch_create::make_tensor_values<double>({3, 2, 1}, {1, 1, 3});
     const auto good_tensor_type = torch_create::make_tensor_values<std::uint8_t>({3, 2, 1}, {1, 1, 3});
     EXPECT_THROW(torch_png::encode(fp / "bt0.png", bad_tensor_type), std::invalid_argument);
     EXPECT_NO_THROW(torch_png::encode(fp / "bt0.png", good_tensor_type));